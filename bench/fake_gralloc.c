@@ -0,0 +1,548 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#include "fake_gralloc.h"
+
+#define FAKE_LOG_E(fmt, ...)  fprintf(stderr, "\x1b[31m[FAKE_GRALLOC_ERR]" \
+									  "\x1b[0m(%d)(%s:%d) " fmt "\n", getpid(), \
+									  __func__, __LINE__, ##__VA_ARGS__)
+
+#define FAKE_ALIGN(x, a)      (((x) + (a) - 1) & ~((a) - 1))
+
+/* the stride of all the formats, YV12 needs 16 pixels */
+#define FAKE_STRIDE_ALIGN     32
+#define FAKE_PAGE_SIZE        4096
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/* the latency of the calls in microseconds, read at the first open */
+static struct {
+	unsigned int alloc_us;
+	unsigned int lock_us;
+	unsigned int unlock_us;
+	unsigned int register_us;
+	unsigned int fence_us;
+} latency;
+
+static pthread_once_t latency_once = PTHREAD_ONCE_INIT;
+
+static fake_gralloc_counters counters;
+
+static unsigned int
+_get_env_us(const char *name)
+{
+	char *env = getenv(name);
+
+	return env ? (unsigned int)strtoul(env, NULL, 10) : 0;
+}
+
+static void
+_latency_init(void)
+{
+	latency.alloc_us = _get_env_us("TBM_FAKE_GRALLOC_ALLOC_US");
+	latency.lock_us = _get_env_us("TBM_FAKE_GRALLOC_LOCK_US");
+	latency.unlock_us = _get_env_us("TBM_FAKE_GRALLOC_UNLOCK_US");
+	latency.register_us = _get_env_us("TBM_FAKE_GRALLOC_REGISTER_US");
+	latency.fence_us = _get_env_us("TBM_FAKE_GRALLOC_FENCE_US");
+}
+
+/* the driver sleeps in the ioctl, so the caller's cpu is free meanwhile */
+static void
+_delay(unsigned int us)
+{
+	struct timespec ts;
+
+	if (!us)
+		return;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000L;
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static void
+_count(uint64_t *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static fake_gralloc_handle *
+_handle_get(buffer_handle_t handle)
+{
+	fake_gralloc_handle *hnd = (fake_gralloc_handle *)handle;
+
+	if (!hnd || hnd->common.version != sizeof(native_handle_t) ||
+		hnd->common.numFds != FAKE_GRALLOC_NUM_FDS ||
+		hnd->common.numInts != FAKE_GRALLOC_NUM_INTS ||
+		hnd->magic != FAKE_GRALLOC_MAGIC) {
+		FAKE_LOG_E("handle:%p isn't a fake gralloc handle", handle);
+		_count(&counters.errors);
+		return NULL;
+	}
+
+	return hnd;
+}
+
+static void *
+_handle_base(const fake_gralloc_handle *hnd)
+{
+	return (void *)(uintptr_t)((uint64_t)(uint32_t)hnd->base_hi << 32 |
+							   (uint32_t)hnd->base_lo);
+}
+
+static void
+_handle_set_base(fake_gralloc_handle *hnd, void *base)
+{
+	uint64_t addr = (uintptr_t)base;
+
+	hnd->base_lo = (int)(uint32_t)addr;
+	hnd->base_hi = (int)(uint32_t)(addr >> 32);
+}
+
+/* @brief get the bytes per pixel of the format, 0 for the yuv ones */
+static int
+_format_bpp(int format)
+{
+	switch (format) {
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		return 4;
+	case HAL_PIXEL_FORMAT_RGB_888:
+		return 3;
+	case HAL_PIXEL_FORMAT_RGB_565:
+	case HAL_PIXEL_FORMAT_RGBA_4444:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* @brief get the size of the buffer, -1 if the format isn't supported */
+static int
+_format_size(int format, int stride, int height)
+{
+	int bpp = _format_bpp(format);
+
+	if (bpp)
+		return FAKE_ALIGN(stride * height * bpp, FAKE_PAGE_SIZE);
+
+	switch (format) {
+	case HAL_PIXEL_FORMAT_YV12:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case 0x105: /* the vendor NV12 of exynos */
+	case 0x109: /* the vendor NV12 of qcom */
+		/* the luma plane and the chroma planes of any vendor alignment */
+		return FAKE_ALIGN(stride * FAKE_ALIGN(height, 2) * 2, FAKE_PAGE_SIZE);
+	default:
+		return -1;
+	}
+}
+
+static int
+fake_alloc(alloc_device_t *dev, int w, int h, int format, int usage,
+		   buffer_handle_t *handle, int *stride)
+{
+	fake_gralloc_handle *hnd;
+	void *base;
+	int fd, size, s;
+
+	if (w <= 0 || h <= 0 || !handle || !stride)
+		return -EINVAL;
+
+	s = FAKE_ALIGN(w, FAKE_STRIDE_ALIGN);
+	size = _format_size(format, s, h);
+	if (size < 0) {
+		FAKE_LOG_E("format:0x%x isn't supported", format);
+		return -EINVAL;
+	}
+
+	_delay(latency.alloc_us);
+
+	fd = syscall(__NR_memfd_create, "fake-gralloc", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	hnd = calloc(1, sizeof(*hnd));
+	if (!hnd) {
+		munmap(base, size);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	hnd->common.version = sizeof(native_handle_t);
+	hnd->common.numFds = FAKE_GRALLOC_NUM_FDS;
+	hnd->common.numInts = FAKE_GRALLOC_NUM_INTS;
+	hnd->fd = fd;
+	hnd->magic = FAKE_GRALLOC_MAGIC;
+	hnd->size = size;
+	hnd->usage = usage;
+	hnd->width = w;
+	hnd->height = h;
+	hnd->format = format;
+	hnd->qcom_format = format;
+	hnd->qcom_width = w;
+	hnd->qcom_height = h;
+	hnd->stride = s;
+	_handle_set_base(hnd, base);
+
+	_count(&counters.allocs);
+
+	*handle = &hnd->common;
+	*stride = s;
+
+	return 0;
+}
+
+static int
+fake_free(alloc_device_t *dev, buffer_handle_t handle)
+{
+	fake_gralloc_handle *hnd = _handle_get(handle);
+
+	if (!hnd)
+		return -EINVAL;
+
+	if (hnd->lock_cnt) {
+		FAKE_LOG_E("handle:%p is freed while locked", handle);
+		_count(&counters.errors);
+	}
+
+	munmap(_handle_base(hnd), hnd->size);
+	close(hnd->fd);
+	free(hnd);
+
+	_count(&counters.frees);
+
+	return 0;
+}
+
+static int
+fake_register(const gralloc_module_t *module, buffer_handle_t handle)
+{
+	fake_gralloc_handle *hnd = _handle_get(handle);
+	void *base;
+
+	if (!hnd)
+		return -EINVAL;
+
+	_delay(latency.register_us);
+
+	/* the handle came from another process, it's mapped here anew */
+	base = mmap(NULL, hnd->size, PROT_READ | PROT_WRITE, MAP_SHARED, hnd->fd, 0);
+	if (base == MAP_FAILED)
+		return -errno;
+
+	_handle_set_base(hnd, base);
+	hnd->lock_cnt = 0;
+
+	_count(&counters.registers);
+
+	return 0;
+}
+
+static int
+fake_unregister(const gralloc_module_t *module, buffer_handle_t handle)
+{
+	fake_gralloc_handle *hnd = _handle_get(handle);
+
+	if (!hnd)
+		return -EINVAL;
+
+	if (hnd->lock_cnt) {
+		FAKE_LOG_E("handle:%p is unregistered while locked", handle);
+		_count(&counters.errors);
+	}
+
+	munmap(_handle_base(hnd), hnd->size);
+	_handle_set_base(hnd, NULL);
+
+	_count(&counters.unregisters);
+
+	return 0;
+}
+
+static int
+fake_lock(const gralloc_module_t *module, buffer_handle_t handle, int usage,
+		  int l, int t, int w, int h, void **vaddr)
+{
+	fake_gralloc_handle *hnd = _handle_get(handle);
+
+	if (!hnd || !vaddr)
+		return -EINVAL;
+
+	if (l < 0 || t < 0 || w < 0 || h < 0 || l + w > hnd->width ||
+		t + h > hnd->height) {
+		FAKE_LOG_E("handle:%p, region %d,%d %dx%d is out of %dx%d", handle,
+				   l, t, w, h, hnd->width, hnd->height);
+		_count(&counters.errors);
+		return -EINVAL;
+	}
+
+	/* the buffer is locked by one user at a time, like the cache owner */
+	if (__atomic_add_fetch(&hnd->lock_cnt, 1, __ATOMIC_ACQ_REL) != 1) {
+		__atomic_sub_fetch(&hnd->lock_cnt, 1, __ATOMIC_ACQ_REL);
+		FAKE_LOG_E("handle:%p is already locked", handle);
+		_count(&counters.errors);
+		return -EBUSY;
+	}
+
+	_delay(latency.lock_us);
+
+	*vaddr = _handle_base(hnd);
+
+	_count(&counters.locks);
+
+	return 0;
+}
+
+static int
+fake_unlock(const gralloc_module_t *module, buffer_handle_t handle)
+{
+	fake_gralloc_handle *hnd = _handle_get(handle);
+
+	if (!hnd)
+		return -EINVAL;
+
+	if (__atomic_load_n(&hnd->lock_cnt, __ATOMIC_ACQUIRE) != 1) {
+		FAKE_LOG_E("handle:%p isn't locked", handle);
+		_count(&counters.errors);
+		return -EINVAL;
+	}
+
+	_delay(latency.unlock_us);
+
+	__atomic_store_n(&hnd->lock_cnt, 0, __ATOMIC_RELEASE);
+
+	_count(&counters.unlocks);
+
+	return 0;
+}
+
+int
+fake_gralloc_fence_create(unsigned int us)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	/* the zero value disarms the timer, 1ns makes the fence signalled */
+	memset(&its, 0x0, sizeof(its));
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = us ? (us % 1000000) * 1000L : 1;
+
+	if (timerfd_settime(fd, 0, &its, NULL)) {
+		close(fd);
+		return -1;
+	}
+
+	_count(&counters.fences);
+
+	return fd;
+}
+
+/* waits for the fence and closes it, the fence is owned by the module */
+static int
+_fence_wait(int fence_fd)
+{
+	struct pollfd fds;
+	int ret;
+
+	if (fence_fd < 0)
+		return 0;
+
+	if (fcntl(fence_fd, F_GETFD) < 0) {
+		FAKE_LOG_E("fence:%d isn't open, its ownership is lost", fence_fd);
+		_count(&counters.errors);
+		return -EINVAL;
+	}
+
+	fds.fd = fence_fd;
+	fds.events = POLLIN;
+
+	do {
+		ret = poll(&fds, 1, -1);
+	} while (ret < 0 && errno == EINTR);
+
+	close(fence_fd);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static int
+fake_lock_async(const gralloc_module_t *module, buffer_handle_t handle,
+				int usage, int l, int t, int w, int h, void **vaddr,
+				int fence_fd)
+{
+	int ret;
+
+	ret = _fence_wait(fence_fd);
+	if (ret)
+		return ret;
+
+	ret = fake_lock(module, handle, usage, l, t, w, h, vaddr);
+	if (!ret)
+		_count(&counters.async_locks);
+
+	return ret;
+}
+
+static int
+fake_unlock_async(const gralloc_module_t *module, buffer_handle_t handle,
+				  int *fence_fd)
+{
+	int ret;
+
+	if (!fence_fd)
+		return -EINVAL;
+
+	*fence_fd = -1;
+
+	ret = fake_unlock(module, handle);
+	if (ret)
+		return ret;
+
+	/* the cache clean goes on after the call, the fence tells when it's done */
+	if (latency.fence_us)
+		*fence_fd = fake_gralloc_fence_create(latency.fence_us);
+
+	_count(&counters.async_unlocks);
+
+	return 0;
+}
+
+static int
+fake_device_close(struct hw_device_t *device)
+{
+	free(device);
+
+	return 0;
+}
+
+static int
+fake_device_open(const struct hw_module_t *module, const char *name,
+				 struct hw_device_t **device)
+{
+	alloc_device_t *dev;
+
+	if (strcmp(name, GRALLOC_HARDWARE_GPU0))
+		return -EINVAL;
+
+	pthread_once(&latency_once, _latency_init);
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+
+	dev->common.tag = HARDWARE_DEVICE_TAG;
+	dev->common.version = 0;
+	dev->common.module = (struct hw_module_t *)module;
+	dev->common.close = fake_device_close;
+	dev->alloc = fake_alloc;
+	dev->free = fake_free;
+
+	*device = &dev->common;
+
+	return 0;
+}
+
+void
+fake_gralloc_get_counters(fake_gralloc_counters *out)
+{
+	out->allocs = __atomic_load_n(&counters.allocs, __ATOMIC_RELAXED);
+	out->frees = __atomic_load_n(&counters.frees, __ATOMIC_RELAXED);
+	out->registers = __atomic_load_n(&counters.registers, __ATOMIC_RELAXED);
+	out->unregisters = __atomic_load_n(&counters.unregisters, __ATOMIC_RELAXED);
+	out->locks = __atomic_load_n(&counters.locks, __ATOMIC_RELAXED);
+	out->unlocks = __atomic_load_n(&counters.unlocks, __ATOMIC_RELAXED);
+	out->async_locks = __atomic_load_n(&counters.async_locks, __ATOMIC_RELAXED);
+	out->async_unlocks = __atomic_load_n(&counters.async_unlocks,
+										 __ATOMIC_RELAXED);
+	out->fences = __atomic_load_n(&counters.fences, __ATOMIC_RELAXED);
+	out->errors = __atomic_load_n(&counters.errors, __ATOMIC_RELAXED);
+}
+
+static struct hw_module_methods_t fake_module_methods = {
+	.open = fake_device_open,
+};
+
+gralloc_module_t HAL_MODULE_INFO_SYM = {
+	.common = {
+		.tag = HARDWARE_MODULE_TAG,
+		.module_api_version = GRALLOC_MODULE_API_VERSION_0_2,
+		.hal_api_version = 0,
+		.id = GRALLOC_HARDWARE_MODULE_ID,
+		.name = "libtbm_android stand-in gralloc",
+		.author = "libtbm_android",
+		.methods = &fake_module_methods,
+	},
+	.registerBuffer = fake_register,
+	.unregisterBuffer = fake_unregister,
+	.lock = fake_lock,
+	.unlock = fake_unlock,
+	.lockAsync = fake_lock_async,
+	.unlockAsync = fake_unlock_async,
+};
@@ -0,0 +1,124 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifndef _FAKE_GRALLOC_H_
+#define _FAKE_GRALLOC_H_
+
+#include <stdint.h>
+#include <hardware/hardware.h>
+#include <hardware/gralloc.h>
+
+/*
+ * The stand-in gralloc.
+ *
+ * It allocates the buffers from memfd and maps them with mmap, so the
+ * backend runs on a host without the android hardware. The library built
+ * from it is loaded by TBM_BACKEND_GRALLOC=<path>, the benchmark links it
+ * in and gets it from hw_get_module.
+ *
+ * The calls take as long as the environment tells, in microseconds:
+ *  - TBM_FAKE_GRALLOC_ALLOC_US    the alloc of the alloc device,
+ *  - TBM_FAKE_GRALLOC_LOCK_US     the lock, e.g. the cache invalidation,
+ *  - TBM_FAKE_GRALLOC_UNLOCK_US   the unlock, e.g. the cache clean,
+ *  - TBM_FAKE_GRALLOC_REGISTER_US the registration of the imported buffer,
+ *  - TBM_FAKE_GRALLOC_FENCE_US    the release fence of unlockAsync to get
+ *                                 signalled, no fence is given for 0.
+ *
+ * The fences are timerfds, they get readable (signalled) when the timer
+ * expires. lockAsync takes the ownership of the acquire fence as gralloc
+ * does: it fails if the fd isn't open, e.g. the caller has closed it, and it
+ * closes the fd in any case.
+ */
+
+/* the magic of the fake_gralloc_handle */
+#define FAKE_GRALLOC_MAGIC 0x46474c43 /* "FGLC" */
+
+/*
+ * The handle keeps the metadata where the backend reads it for the import:
+ * the usage, width, height and format from data[numFds + 4], and the
+ * format, width and height from data[numFds + 8] for QCOM_BSP.
+ */
+typedef struct _fake_gralloc_handle {
+	native_handle_t common;
+	int fd;
+	int magic;
+	int size;
+	int base_lo;         /* the mapping of this process, set by the alloc */
+	int base_hi;         /* or the registration */
+	int usage;
+	int width;
+	int height;
+	int format;
+	int qcom_format;
+	int qcom_width;
+	int qcom_height;
+	int stride;          /* in pixels */
+	int lock_cnt;
+} fake_gralloc_handle;
+
+#define FAKE_GRALLOC_NUM_FDS  1
+#define FAKE_GRALLOC_NUM_INTS \
+	((int)((sizeof(fake_gralloc_handle) - sizeof(native_handle_t)) / sizeof(int)) - \
+	 FAKE_GRALLOC_NUM_FDS)
+
+/* the calls of the module so far */
+typedef struct _fake_gralloc_counters {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t registers;
+	uint64_t unregisters;
+	uint64_t locks;
+	uint64_t unlocks;
+	uint64_t async_locks;  /* the part of the locks done by lockAsync */
+	uint64_t async_unlocks;
+	uint64_t fences;       /* the fences made by the module */
+	uint64_t errors;       /* the calls with a wrong handle or out of order */
+} fake_gralloc_counters;
+
+/**
+ * @brief get the counters of the module calls.
+ * @param[out] counters : the counters
+ */
+void
+fake_gralloc_get_counters(fake_gralloc_counters *counters);
+
+/**
+ * @brief make the fence signalled after @c us microseconds.
+ * @note The caller takes the ownership of the fence, e.g. to hand it to the
+ * backend as the acquire fence of a bo the gpu renders to.
+ * @return the fence fd or -1 in an error case.
+ */
+int
+fake_gralloc_fence_create(unsigned int us);
+
+extern gralloc_module_t HAL_MODULE_INFO_SYM;
+
+#endif /* _FAKE_GRALLOC_H_ */
@@ -0,0 +1,51 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+
+/*
+ * The host build of the benchmark: the native handle of libcutils, see
+ * tbm_bufmgr.h. The backend and the stand-in gralloc manage the handles
+ * themselves, so none of the libcutils functions are declared.
+ */
+
+#ifndef _CUTILS_NATIVE_HANDLE_H_
+#define _CUTILS_NATIVE_HANDLE_H_
+
+typedef struct native_handle {
+	int version;        /* sizeof(native_handle_t) */
+	int numFds;
+	int numInts;
+	int data[0];        /* the fds, then the ints */
+} native_handle_t;
+
+typedef const native_handle_t *buffer_handle_t;
+
+#endif /* _CUTILS_NATIVE_HANDLE_H_ */
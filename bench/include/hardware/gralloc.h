@@ -0,0 +1,143 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+
+/* the host build of the benchmark: the gralloc HAL, see tbm_bufmgr.h */
+
+#ifndef _HARDWARE_GRALLOC_H_
+#define _HARDWARE_GRALLOC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <hardware/hardware.h>
+
+#define GRALLOC_MODULE_API_VERSION_0_1 HARDWARE_MODULE_API_VERSION(0, 1)
+#define GRALLOC_MODULE_API_VERSION_0_2 HARDWARE_MODULE_API_VERSION(0, 2)
+#define GRALLOC_MODULE_API_VERSION_0_3 HARDWARE_MODULE_API_VERSION(0, 3)
+
+#define GRALLOC_HARDWARE_MODULE_ID "gralloc"
+#define GRALLOC_HARDWARE_GPU0      "gpu0"
+
+enum {
+	GRALLOC_USAGE_SW_READ_NEVER = 0x00000000,
+	GRALLOC_USAGE_SW_READ_RARELY = 0x00000002,
+	GRALLOC_USAGE_SW_READ_OFTEN = 0x00000003,
+	GRALLOC_USAGE_SW_READ_MASK = 0x0000000F,
+	GRALLOC_USAGE_SW_WRITE_NEVER = 0x00000000,
+	GRALLOC_USAGE_SW_WRITE_RARELY = 0x00000020,
+	GRALLOC_USAGE_SW_WRITE_OFTEN = 0x00000030,
+	GRALLOC_USAGE_SW_WRITE_MASK = 0x000000F0,
+	GRALLOC_USAGE_HW_TEXTURE = 0x00000100,
+	GRALLOC_USAGE_HW_RENDER = 0x00000200,
+	GRALLOC_USAGE_HW_2D = 0x00000400,
+	GRALLOC_USAGE_HW_COMPOSER = 0x00000800,
+	GRALLOC_USAGE_HW_FB = 0x00001000,
+	GRALLOC_USAGE_EXTERNAL_DISP = 0x00002000,
+	GRALLOC_USAGE_PROTECTED = 0x00004000,
+	GRALLOC_USAGE_CURSOR = 0x00008000,
+	GRALLOC_USAGE_HW_VIDEO_ENCODER = 0x00010000,
+	GRALLOC_USAGE_HW_CAMERA_WRITE = 0x00020000,
+	GRALLOC_USAGE_HW_CAMERA_READ = 0x00040000,
+	GRALLOC_USAGE_HW_CAMERA_ZSL = 0x00060000,
+	GRALLOC_USAGE_HW_CAMERA_MASK = 0x00060000,
+	GRALLOC_USAGE_HW_MASK = 0x00071F00,
+	GRALLOC_USAGE_RENDERSCRIPT = 0x00100000,
+	GRALLOC_USAGE_FOREIGN_BUFFERS = 0x00200000,
+	GRALLOC_USAGE_PRIVATE_0 = 0x10000000,
+	GRALLOC_USAGE_PRIVATE_1 = 0x20000000,
+	GRALLOC_USAGE_PRIVATE_2 = 0x40000000,
+	GRALLOC_USAGE_PRIVATE_3 = 0x80000000,
+	GRALLOC_USAGE_PRIVATE_MASK = 0xF0000000,
+};
+
+struct android_ycbcr {
+	void *y;
+	void *cb;
+	void *cr;
+	size_t ystride;
+	size_t cstride;
+	size_t chroma_step;
+	uint32_t reserved[8];
+};
+
+typedef struct gralloc_module_t {
+	struct hw_module_t common;
+
+	int (*registerBuffer)(struct gralloc_module_t const *module,
+						  buffer_handle_t handle);
+	int (*unregisterBuffer)(struct gralloc_module_t const *module,
+							buffer_handle_t handle);
+	int (*lock)(struct gralloc_module_t const *module, buffer_handle_t handle,
+				int usage, int l, int t, int w, int h, void **vaddr);
+	int (*unlock)(struct gralloc_module_t const *module,
+				  buffer_handle_t handle);
+	int (*perform)(struct gralloc_module_t const *module, int operation, ...);
+	int (*lock_ycbcr)(struct gralloc_module_t const *module,
+					  buffer_handle_t handle, int usage, int l, int t, int w,
+					  int h, struct android_ycbcr *ycbcr);
+	int (*lockAsync)(struct gralloc_module_t const *module,
+					 buffer_handle_t handle, int usage, int l, int t, int w,
+					 int h, void **vaddr, int fenceFd);
+	int (*unlockAsync)(struct gralloc_module_t const *module,
+					   buffer_handle_t handle, int *fenceFd);
+	int (*lockAsync_ycbcr)(struct gralloc_module_t const *module,
+						   buffer_handle_t handle, int usage, int l, int t,
+						   int w, int h, struct android_ycbcr *ycbcr,
+						   int fenceFd);
+
+	void *reserved_proc[3];
+} gralloc_module_t;
+
+typedef struct alloc_device_t {
+	struct hw_device_t common;
+
+	int (*alloc)(struct alloc_device_t *dev, int w, int h, int format,
+				 int usage, buffer_handle_t *handle, int *stride);
+	int (*free)(struct alloc_device_t *dev, buffer_handle_t handle);
+	void (*dump)(struct alloc_device_t *dev, char *buff, int buff_len);
+
+	void *reserved_proc[7];
+} alloc_device_t;
+
+static inline int
+gralloc_open(const struct hw_module_t *module, struct alloc_device_t **device)
+{
+	return module->methods->open(module, GRALLOC_HARDWARE_GPU0,
+								 (struct hw_device_t **)device);
+}
+
+static inline int
+gralloc_close(struct alloc_device_t *device)
+{
+	return device->common.close(&device->common);
+}
+
+#endif /* _HARDWARE_GRALLOC_H_ */
@@ -0,0 +1,93 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+
+/* the host build of the benchmark: the HAL module API, see tbm_bufmgr.h */
+
+#ifndef _HARDWARE_HARDWARE_H_
+#define _HARDWARE_HARDWARE_H_
+
+#include <stdint.h>
+#include <cutils/native_handle.h>
+#include <system/graphics.h>
+
+/* bionic defines it in its libc headers, glibc doesn't */
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define MAKE_TAG_CONSTANT(A, B, C, D) \
+	(((A) << 24) | ((B) << 16) | ((C) << 8) | (D))
+
+#define HARDWARE_MODULE_TAG MAKE_TAG_CONSTANT('H', 'W', 'M', 'T')
+#define HARDWARE_DEVICE_TAG MAKE_TAG_CONSTANT('H', 'W', 'D', 'T')
+
+#define HARDWARE_MODULE_API_VERSION(maj, min) \
+	((uint16_t)(((maj) << 8) | ((min) & 0xff)))
+#define HARDWARE_DEVICE_API_VERSION(maj, min) \
+	((((maj) & 0xff) << 8) | ((min) & 0xff))
+#define HARDWARE_HAL_API_VERSION HARDWARE_DEVICE_API_VERSION(1, 0)
+
+struct hw_module_t;
+struct hw_device_t;
+
+typedef struct hw_module_methods_t {
+	int (*open)(const struct hw_module_t *module, const char *id,
+				struct hw_device_t **device);
+} hw_module_methods_t;
+
+typedef struct hw_module_t {
+	uint32_t tag;
+	uint16_t module_api_version;
+	uint16_t hal_api_version;
+	const char *id;
+	const char *name;
+	const char *author;
+	struct hw_module_methods_t *methods;
+	void *dso;
+	uint32_t reserved[32 - 7];
+} hw_module_t;
+
+typedef struct hw_device_t {
+	uint32_t tag;
+	uint32_t version;
+	struct hw_module_t *module;
+	uint32_t reserved[12];
+	int (*close)(struct hw_device_t *device);
+} hw_device_t;
+
+#define HAL_MODULE_INFO_SYM         HMI
+#define HAL_MODULE_INFO_SYM_AS_STR  "HMI"
+
+/* implemented by the host of the benchmark, it gives the stand-in gralloc */
+int hw_get_module(const char *id, const struct hw_module_t **module);
+
+#endif /* _HARDWARE_HARDWARE_H_ */
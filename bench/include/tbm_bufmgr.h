@@ -0,0 +1,75 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+
+/*
+ * The benchmark is built on a host without libtbm and the android headers.
+ * The headers here declare the part of their API the backend, the stand-in
+ * gralloc and the benchmark use, with the same values and layouts.
+ */
+
+#ifndef _TBM_BUFMGR_H_
+#define _TBM_BUFMGR_H_
+
+#include <stdint.h>
+
+typedef struct _tbm_bufmgr *tbm_bufmgr;
+typedef struct _tbm_bo *tbm_bo;
+typedef uint32_t tbm_key;
+typedef int32_t tbm_fd;
+
+typedef union _tbm_bo_handle {
+	void *ptr;
+	int32_t s32;
+	uint32_t u32;
+	int64_t s64;
+	uint64_t u64;
+} tbm_bo_handle;
+
+#define TBM_DEVICE_DEFAULT  0
+#define TBM_DEVICE_CPU      1
+#define TBM_DEVICE_2D       2
+#define TBM_DEVICE_3D       3
+#define TBM_DEVICE_MM       4
+
+#define TBM_OPTION_READ     (1 << 0)
+#define TBM_OPTION_WRITE    (1 << 1)
+#define TBM_OPTION_VENDOR   (0xffff0000)
+
+enum TBM_BO_FLAGS {
+	TBM_BO_DEFAULT = 0,
+	TBM_BO_SCANOUT = (1 << 0),
+	TBM_BO_NONCACHABLE = (1 << 1),
+	TBM_BO_WC = (1 << 2),
+	TBM_BO_VENDOR = (0xffff0000)
+};
+
+#endif /* _TBM_BUFMGR_H_ */
@@ -0,0 +1,99 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+
+/* the host build of the benchmark: the backend API of libtbm, see tbm_bufmgr.h */
+
+#ifndef _TBM_BUFMGR_BACKEND_H_
+#define _TBM_BUFMGR_BACKEND_H_
+
+#include <stdint.h>
+#include <tbm_bufmgr.h>
+#include <tbm_surface.h>
+
+#define TBM_ABI_VERSION 0x10000
+
+typedef struct _tbm_bufmgr_backend *tbm_bufmgr_backend;
+
+struct _tbm_bufmgr_backend {
+	int flags;
+	void *priv;
+
+	void (*bufmgr_deinit)(void *priv);
+	int (*bo_size)(tbm_bo bo);
+	void *(*bo_alloc)(tbm_bo bo, int size, int flags);
+	void (*bo_free)(tbm_bo bo);
+	void *(*bo_import)(tbm_bo bo, unsigned int key);
+	unsigned int (*bo_export)(tbm_bo bo);
+	tbm_bo_handle (*bo_get_handle)(tbm_bo bo, int device);
+	tbm_bo_handle (*bo_map)(tbm_bo bo, int device, int opt);
+	int (*bo_unmap)(tbm_bo bo);
+	int (*bo_lock)(tbm_bo bo, int device, int opt);
+	int (*bo_unlock)(tbm_bo bo);
+	int (*surface_supported_format)(uint32_t **formats, uint32_t *num);
+	int (*surface_get_plane_data)(int width, int height, tbm_format format,
+								  int plane_idx, uint32_t *size,
+								  uint32_t *offset, uint32_t *pitch,
+								  int *bo_idx);
+	void *(*bo_import_fd)(tbm_bo bo, tbm_fd fd);
+	tbm_fd (*bo_export_fd)(tbm_bo bo);
+	int (*bo_get_flags)(tbm_bo bo);
+	int (*bufmgr_bind_native_display)(tbm_bufmgr bufmgr, void *NativeDisplay);
+	void *(*surface_bo_alloc)(tbm_bo bo, int width, int height, int format,
+							  int flags, int bo_idx);
+	void *(*bo_import_)(tbm_bo bo, const void *native);
+	const void *(*bo_export_)(tbm_bo bo);
+
+	void *reserved[4];
+};
+
+typedef struct {
+	const char *modname;
+	const char *vendor;
+	unsigned long abiversion;
+} TBMModuleVersionInfo;
+
+typedef int (*ModuleInitProc)(tbm_bufmgr, int);
+
+typedef struct {
+	TBMModuleVersionInfo *vers;
+	ModuleInitProc init;
+} TBMModuleData;
+
+/* implemented by the host of the benchmark, tbm_android_bench_host.c */
+tbm_bufmgr_backend tbm_backend_alloc(void);
+void tbm_backend_free(tbm_bufmgr_backend backend);
+int tbm_backend_init(tbm_bufmgr bufmgr, tbm_bufmgr_backend backend);
+void *tbm_backend_get_bufmgr_priv(tbm_bo bo);
+void *tbm_backend_get_priv_from_bufmgr(tbm_bufmgr bufmgr);
+void *tbm_backend_get_bo_priv(tbm_bo bo);
+
+#endif /* _TBM_BUFMGR_BACKEND_H_ */
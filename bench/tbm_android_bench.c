@@ -0,0 +1,1018 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+/*
+ * The benchmark of the backend entry points.
+ *
+ * The backend runs against the stand-in gralloc (see fake_gralloc.h), every
+ * test calls one entry point or a pair of them the number of times given
+ * from the given number of threads and reports the throughput and the
+ * latency percentiles of the calls, followed by the gralloc calls they
+ * cost. E.g.
+ *
+ *   TBM_FAKE_GRALLOC_LOCK_US=20 tbm_android_bench -t 4 map_unmap
+ *
+ * The async lock of the backend is taken with TBM_BACKEND_ASYNC_LOCK=1, the
+ * map_fenced test then hands the fences over with lockAsync/unlockAsync:
+ *
+ *   TBM_BACKEND_ASYNC_LOCK=1 TBM_FAKE_GRALLOC_FENCE_US=100 \
+ *   tbm_android_bench -a 200 map_fenced
+ *
+ * The persistent mapping is compared with the lock of every map by
+ *
+ *   TBM_FAKE_GRALLOC_LOCK_US=20 TBM_FAKE_GRALLOC_UNLOCK_US=20 \
+ *   tbm_android_bench map_unmap map_persistent map_persistent_2d
+ *
+ * plane_data_formats and alloc_formats take every supported format in turn
+ * instead of -f, so the format lookups don't always hit the same entry.
+ *
+ * The formats gralloc lacks are converted by the backend, map_write gives
+ * their MB/s to compare with the formats of the same bytes gralloc has:
+ *
+ *   tbm_android_bench -f XR24 map_write; tbm_android_bench -f AR24 map_write
+ *
+ * bo_copy and bo_fill are compared with the loops of the clients over the
+ * maps by copy, copy_naive, fill and fill_naive.
+ *
+ * The scaling of the calls over the cores is shown by -s, the tests run with
+ * 1, 2, 4 ... threads up to -t:
+ *
+ *   tbm_android_bench -s -t 8 map_shared map_shared_held
+ *
+ * Usage: tbm_android_bench [-w width] [-h height] [-f fourcc] [-n iterations]
+ *                          [-t threads] [-s] [-a acquire fence us] [-l]
+ *                          [test ...]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <tbm_surface.h>
+
+#include "fake_gralloc.h"
+#include "tbm_android_bench.h"
+#include "tbm_bufmgr_android.h"
+
+struct bench_test;
+
+/* the options of the run */
+struct bench_opts {
+	int width;
+	int height;
+	int format;
+	int iterations;
+	int threads;
+	int scale;              /* run with 1, 2, 4 ... threads up to threads */
+	unsigned int fence_us;  /* the acquire fences get signalled after it */
+	uint32_t *formats;      /* the formats the backend supports */
+	uint32_t num_formats;
+};
+
+struct bench_thread {
+	const struct bench_test *test;
+	const struct bench_opts *opts;
+	tbm_bufmgr bufmgr;
+	pthread_barrier_t *barrier;
+	pthread_t thread;
+	uint64_t *samples;     /* the latency of every call in ns */
+	uint64_t start;        /* the time of the first and after the last call */
+	uint64_t end;
+	int failed;
+	tbm_bo bo;             /* the bo of the thread, if the test wants one */
+	native_handle_t *native;
+	tbm_bo src;            /* the second bo of the thread, to copy from */
+	int calls;             /* the calls of run so far */
+};
+
+/* the thread gets a bo of the surface */
+#define BENCH_BO      (1 << 0)
+/* the test leaves no fd open, e.g. no fence, so the leaks are caught */
+#define BENCH_NO_FDS  (1 << 1)
+/* all the threads get the same bo */
+#define BENCH_SHARED  (1 << 2)
+/* the shared bo stays mapped for the cpu during the test */
+#define BENCH_MAPPED  (1 << 3)
+/* the bos of the threads keep the cpu mapping between the maps */
+#define BENCH_PERSISTENT (1 << 4)
+
+/* the calls go over the whole surface, their MB/s are reported */
+#define BENCH_BYTES   (1 << 5)
+
+/* the thread gets a second bo of the surface, the source of the copies */
+#define BENCH_SRC     (1 << 6)
+
+/* the pixel of the fills, opaque green in the 8888 formats */
+#define BENCH_PIXEL   0xff00ff00
+
+/* the device accesses the persistently mapped bo every so many maps */
+#define BENCH_DEVICE_PERIOD 10
+
+struct bench_test {
+	const char *name;
+	const char *desc;
+	int flags;
+	/* an untimed step before every call, optional */
+	int (*prepare)(struct bench_thread *t);
+	/* the timed call, returns 1 on success */
+	int (*run)(struct bench_thread *t);
+	/* releases what prepare left, optional */
+	void (*cleanup)(struct bench_thread *t);
+};
+
+static uint64_t
+_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static tbm_bufmgr_backend
+_backend(struct bench_thread *t)
+{
+	return t->bufmgr->backend;
+}
+
+static int
+_run_alloc_free(struct bench_thread *t)
+{
+	const struct bench_opts *opts = t->opts;
+	tbm_bo bo;
+
+	bo = bench_bo_alloc(t->bufmgr, opts->width, opts->height, opts->format,
+						TBM_BO_DEFAULT);
+	if (!bo)
+		return 0;
+
+	bench_bo_unref(bo);
+
+	return 1;
+}
+
+static int
+_run_map_unmap(struct bench_thread *t)
+{
+	tbm_bo_handle handle;
+
+	handle = _backend(t)->bo_map(t->bo, TBM_DEVICE_CPU,
+								 TBM_OPTION_READ | TBM_OPTION_WRITE);
+	if (!handle.ptr)
+		return 0;
+
+	return _backend(t)->bo_unmap(t->bo);
+}
+
+/* the formats gralloc lacks are converted at the lock and the unlock */
+static int
+_run_map_write(struct bench_thread *t)
+{
+	tbm_bo_handle handle;
+
+	handle = _backend(t)->bo_map(t->bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	if (!handle.ptr)
+		return 0;
+
+	memset(handle.ptr, 0xff, _backend(t)->bo_size(t->bo));
+
+	return _backend(t)->bo_unmap(t->bo);
+}
+
+static int
+_run_copy(struct bench_thread *t)
+{
+	return tbm_android_bo_copy(t->bo, 0, 0, t->src, 0, 0, t->opts->width,
+							   t->opts->height);
+}
+
+/* what the clients did before bo_copy: memcpy of every row of the maps */
+static int
+_run_copy_naive(struct bench_thread *t)
+{
+	const struct bench_opts *opts = t->opts;
+	tbm_bo_handle dst, src;
+	uint32_t size, offset, pitch;
+	int bo_idx, y, ret;
+
+	if (!_backend(t)->surface_get_plane_data(opts->width, opts->height,
+											 opts->format, 0, &size, &offset,
+											 &pitch, &bo_idx))
+		return 0;
+
+	src = _backend(t)->bo_map(t->src, TBM_DEVICE_CPU, TBM_OPTION_READ);
+	if (!src.ptr)
+		return 0;
+
+	dst = _backend(t)->bo_map(t->bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	if (!dst.ptr) {
+		_backend(t)->bo_unmap(t->src);
+		return 0;
+	}
+
+	for (y = 0; y < opts->height; y++)
+		memcpy((uint8_t *)dst.ptr + offset + y * pitch,
+			   (uint8_t *)src.ptr + offset + y * pitch, pitch);
+
+	ret = _backend(t)->bo_unmap(t->bo);
+
+	return _backend(t)->bo_unmap(t->src) && ret;
+}
+
+static int
+_run_fill(struct bench_thread *t)
+{
+	return tbm_android_bo_fill(t->bo, 0, 0, t->opts->width, t->opts->height,
+							   BENCH_PIXEL);
+}
+
+static int
+_bpp(uint32_t format)
+{
+	switch (format) {
+	case TBM_FORMAT_RGB565:
+	case TBM_FORMAT_BGR565:
+	case TBM_FORMAT_RGBA4444:
+		return 2;
+	case TBM_FORMAT_RGB888:
+	case TBM_FORMAT_BGR888:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+/* what the clients did before bo_fill: the pixels stored one by one */
+static int
+_run_fill_naive(struct bench_thread *t)
+{
+	const struct bench_opts *opts = t->opts;
+	uint32_t size, offset, pitch, pixel = BENCH_PIXEL;
+	tbm_bo_handle handle;
+	uint8_t *row;
+	int bo_idx, bpp, x, y;
+
+	if (!_backend(t)->surface_get_plane_data(opts->width, opts->height,
+											 opts->format, 0, &size, &offset,
+											 &pitch, &bo_idx))
+		return 0;
+
+	handle = _backend(t)->bo_map(t->bo, TBM_DEVICE_CPU, TBM_OPTION_WRITE);
+	if (!handle.ptr)
+		return 0;
+
+	bpp = _bpp(opts->format);
+
+	for (y = 0; y < opts->height; y++) {
+		row = (uint8_t *)handle.ptr + offset + y * pitch;
+		for (x = 0; x < opts->width; x++)
+			memcpy(row + x * bpp, &pixel, bpp);
+	}
+
+	return _backend(t)->bo_unmap(t->bo);
+}
+
+/* the 2d handle flushes the persistent mapping, the next map locks again */
+static int
+_run_map_unmap_2d(struct bench_thread *t)
+{
+	if (++t->calls % BENCH_DEVICE_PERIOD == 0 &&
+		!_backend(t)->bo_get_handle(t->bo, TBM_DEVICE_2D).ptr)
+		return 0;
+
+	return _run_map_unmap(t);
+}
+
+static int
+_run_get_handle_3d(struct bench_thread *t)
+{
+	return !!_backend(t)->bo_get_handle(t->bo, TBM_DEVICE_3D).ptr;
+}
+
+static int
+_run_get_handle_mm(struct bench_thread *t)
+{
+	return _backend(t)->bo_get_handle(t->bo, TBM_DEVICE_MM).u32 > 0;
+}
+
+static void
+_cleanup_native(struct bench_thread *t)
+{
+	int i;
+
+	if (!t->native)
+		return;
+
+	for (i = 0; i < t->native->numFds; i++)
+		close(t->native->data[i]);
+	free(t->native);
+	t->native = NULL;
+}
+
+/* the handle as another process gets it through the binder */
+static int
+_prepare_import(struct bench_thread *t)
+{
+	const native_handle_t *native;
+	size_t size;
+	int i;
+
+	_cleanup_native(t);
+
+	native = _backend(t)->bo_export_(t->bo);
+	if (!native)
+		return 0;
+
+	size = sizeof(native_handle_t) +
+		   sizeof(int) * (native->numFds + native->numInts);
+	t->native = malloc(size);
+	if (!t->native)
+		return 0;
+
+	memcpy(t->native, native, size);
+	for (i = 0; i < native->numFds; i++)
+		t->native->data[i] = dup(native->data[i]);
+
+	return 1;
+}
+
+static int
+_run_import_free(struct bench_thread *t)
+{
+	tbm_bo bo;
+
+	bo = bench_bo_import(t->bufmgr, t->native);
+	if (!bo)
+		return 0;
+
+	bench_bo_unref(bo);
+
+	return 1;
+}
+
+static int
+_run_export_import_fd(struct bench_thread *t)
+{
+	tbm_fd fd;
+	tbm_bo bo;
+
+	fd = _backend(t)->bo_export_fd(t->bo);
+	if (fd < 0)
+		return 0;
+
+	bo = bench_bo_import_fd(t->bufmgr, fd);
+	close(fd);
+	if (!bo)
+		return 0;
+
+	bench_bo_unref(bo);
+
+	return 1;
+}
+
+static int
+_run_plane_data(struct bench_thread *t)
+{
+	const struct bench_opts *opts = t->opts;
+	uint32_t size, offset, pitch;
+	int bo_idx;
+
+	return _backend(t)->surface_get_plane_data(opts->width, opts->height,
+											   opts->format, 0, &size,
+											   &offset, &pitch, &bo_idx);
+}
+
+static int
+_num_planes(uint32_t format)
+{
+	switch (format) {
+	case TBM_FORMAT_YUV420:
+	case TBM_FORMAT_YVU420:
+		return 3;
+	case TBM_FORMAT_NV12:
+	case TBM_FORMAT_NV21:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/* every call takes the next format, as the clients of many formats do */
+static int
+_run_plane_data_formats(struct bench_thread *t)
+{
+	const struct bench_opts *opts = t->opts;
+	uint32_t format, size, offset, pitch;
+	int plane, bo_idx;
+
+	format = opts->formats[t->calls++ % opts->num_formats];
+
+	for (plane = 0; plane < _num_planes(format); plane++) {
+		if (!_backend(t)->surface_get_plane_data(opts->width, opts->height,
+												 format, plane, &size,
+												 &offset, &pitch, &bo_idx))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int
+_run_alloc_free_formats(struct bench_thread *t)
+{
+	const struct bench_opts *opts = t->opts;
+	tbm_bo bo;
+
+	bo = bench_bo_alloc(t->bufmgr, opts->width, opts->height,
+						opts->formats[t->calls++ % opts->num_formats],
+						TBM_BO_DEFAULT);
+	if (!bo)
+		return 0;
+
+	bench_bo_unref(bo);
+
+	return 1;
+}
+
+/* waits for the release fence of the last unmap, as the gpu would */
+static int
+_wait_release_fence(struct bench_thread *t)
+{
+	struct pollfd fds;
+	int ret;
+
+	fds.fd = tbm_android_bo_get_release_fence(t->bo);
+	if (fds.fd < 0)
+		return 1;
+
+	fds.events = POLLIN;
+
+	do {
+		ret = poll(&fds, 1, -1);
+	} while (ret < 0 && errno == EINTR);
+
+	close(fds.fd);
+
+	return ret > 0;
+}
+
+/* the gpu is going to finish rendering to the bo after the fence delay */
+static int
+_prepare_fenced(struct bench_thread *t)
+{
+	int fence_fd;
+
+	if (!_wait_release_fence(t))
+		return 0;
+
+	fence_fd = fake_gralloc_fence_create(t->opts->fence_us);
+	if (fence_fd < 0)
+		return 0;
+
+	if (!tbm_android_bo_set_acquire_fence(t->bo, fence_fd)) {
+		close(fence_fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+_run_map_fenced(struct bench_thread *t)
+{
+	tbm_bo_handle handle;
+
+	handle = _backend(t)->bo_map(t->bo, TBM_DEVICE_CPU,
+								 TBM_OPTION_READ | TBM_OPTION_WRITE);
+	if (!handle.ptr)
+		return 0;
+
+	*(volatile uint8_t *)handle.ptr = 0xff;
+
+	return _backend(t)->bo_unmap(t->bo);
+}
+
+static void
+_cleanup_fenced(struct bench_thread *t)
+{
+	_wait_release_fence(t);
+}
+
+static const struct bench_test tests[] = {
+	{ "alloc_free", "surface_bo_alloc + bo_free of the same surface", 0,
+	  NULL, _run_alloc_free, NULL },
+	{ "map_unmap", "bo_map(CPU, RW) + bo_unmap", BENCH_BO | BENCH_NO_FDS,
+	  NULL, _run_map_unmap, NULL },
+	{ "map_shared", "bo_map(CPU, RW) + bo_unmap of one bo by all the threads",
+	  BENCH_SHARED | BENCH_NO_FDS, NULL, _run_map_unmap, NULL },
+	{ "map_shared_held", "map_shared while the bo stays mapped, the maps "
+	  "only take a reference", BENCH_SHARED | BENCH_MAPPED | BENCH_NO_FDS,
+	  NULL, _run_map_unmap, NULL },
+	{ "map_write", "bo_map(CPU, W) + write of the surface + bo_unmap, the "
+	  "swizzled formats (XR24, BG16) get converted on every cycle",
+	  BENCH_BO | BENCH_BYTES | BENCH_NO_FDS, NULL, _run_map_write, NULL },
+	{ "copy", "bo_copy of the whole surface from another bo",
+	  BENCH_BO | BENCH_SRC | BENCH_BYTES | BENCH_NO_FDS, NULL, _run_copy,
+	  NULL },
+	{ "copy_naive", "bo_map of both bos + memcpy of every row of the plane 0 "
+	  "+ bo_unmap", BENCH_BO | BENCH_SRC | BENCH_BYTES | BENCH_NO_FDS, NULL,
+	  _run_copy_naive, NULL },
+	{ "fill", "bo_fill of the whole surface", BENCH_BO | BENCH_BYTES |
+	  BENCH_NO_FDS, NULL, _run_fill, NULL },
+	{ "fill_naive", "bo_map + store of every pixel + bo_unmap, the single "
+	  "plane formats", BENCH_BO | BENCH_BYTES | BENCH_NO_FDS, NULL,
+	  _run_fill_naive, NULL },
+	{ "map_persistent", "map_unmap of the persistently mapped bo",
+	  BENCH_BO | BENCH_PERSISTENT | BENCH_NO_FDS, NULL, _run_map_unmap, NULL },
+	{ "map_persistent_2d", "map_persistent with bo_get_handle(2D) every 10th "
+	  "map", BENCH_BO | BENCH_PERSISTENT | BENCH_NO_FDS, NULL,
+	  _run_map_unmap_2d, NULL },
+	{ "map_fenced", "bo_map(CPU, RW) + write + bo_unmap after the acquire "
+	  "fence, the release fence is waited", BENCH_BO | BENCH_NO_FDS,
+	  _prepare_fenced, _run_map_fenced, _cleanup_fenced },
+	{ "get_handle_3d", "bo_get_handle(3D)", BENCH_BO | BENCH_NO_FDS,
+	  NULL, _run_get_handle_3d, NULL },
+	{ "get_handle_mm", "bo_get_handle(MM)", BENCH_BO | BENCH_NO_FDS,
+	  NULL, _run_get_handle_mm, NULL },
+	{ "import_free", "bo_import of a new native handle + bo_free",
+	  BENCH_BO | BENCH_NO_FDS, _prepare_import, _run_import_free,
+	  _cleanup_native },
+	{ "export_import_fd", "bo_export_fd + bo_import_fd + bo_free",
+	  BENCH_BO | BENCH_NO_FDS, NULL, _run_export_import_fd, NULL },
+	{ "plane_data", "surface_get_plane_data of the plane 0", BENCH_NO_FDS,
+	  NULL, _run_plane_data, NULL },
+	{ "plane_data_formats", "surface_get_plane_data of all the planes of "
+	  "the next supported format", BENCH_NO_FDS, NULL,
+	  _run_plane_data_formats, NULL },
+	{ "alloc_formats", "alloc_free of the next supported format", 0,
+	  NULL, _run_alloc_free_formats, NULL },
+};
+
+#define NUM_TESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+static void *
+_bench_thread(void *data)
+{
+	struct bench_thread *t = data;
+	uint64_t start;
+	int i;
+
+	pthread_barrier_wait(t->barrier);
+
+	t->start = _now_ns();
+
+	for (i = 0; i < t->opts->iterations; i++) {
+		if (t->test->prepare && !t->test->prepare(t)) {
+			t->failed = 1;
+			break;
+		}
+
+		start = _now_ns();
+		if (!t->test->run(t)) {
+			t->failed = 1;
+			break;
+		}
+		t->samples[i] = _now_ns() - start;
+	}
+
+	t->end = _now_ns();
+
+	if (t->test->cleanup)
+		t->test->cleanup(t);
+
+	return NULL;
+}
+
+/*
+ * gets the counters of the stand-in gralloc the backend uses, the linked in
+ * one or the one loaded by TBM_BACKEND_GRALLOC. Another gralloc has none.
+ */
+static int
+_gralloc_counters(fake_gralloc_counters *counters)
+{
+	void (*get_counters)(fake_gralloc_counters *) = fake_gralloc_get_counters;
+	char *path = getenv("TBM_BACKEND_GRALLOC");
+	void *dso;
+
+	memset(counters, 0x0, sizeof(*counters));
+
+	if (path) {
+		dso = dlopen(path, RTLD_NOW | RTLD_NOLOAD);
+		if (!dso)
+			return 0;
+
+		*(void **)&get_counters = dlsym(dso, "fake_gralloc_get_counters");
+		dlclose(dso);
+		if (!get_counters)
+			return 0;
+	}
+
+	get_counters(counters);
+
+	return 1;
+}
+
+static int
+_count_fds(void)
+{
+	struct dirent *ent;
+	DIR *dir;
+	int count = 0;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)))
+		count++;
+
+	closedir(dir);
+
+	return count;
+}
+
+static int
+_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+_percentile_us(const uint64_t *sorted, size_t count, int pct)
+{
+	size_t idx = (count * pct + 99) / 100;
+
+	return sorted[idx ? idx - 1 : 0] / 1000.0;
+}
+
+static int
+_bench_run(tbm_bufmgr bufmgr, const struct bench_test *test,
+		   const struct bench_opts *opts)
+{
+	struct bench_thread *threads;
+	fake_gralloc_counters before, after;
+	tbm_bo shared = NULL;
+	pthread_barrier_t barrier;
+	uint64_t *samples, start, end;
+	size_t count;
+	int i, fds, has_counters, bytes = 0, mapped = 0, started = 0, ret = 0;
+
+	threads = calloc(opts->threads, sizeof(*threads));
+	samples = malloc(sizeof(uint64_t) * opts->iterations * opts->threads);
+	if (!threads || !samples)
+		goto done;
+
+	if (test->flags & BENCH_SHARED) {
+		shared = bench_bo_alloc(bufmgr, opts->width, opts->height,
+								opts->format, TBM_BO_DEFAULT);
+		if (!shared) {
+			fprintf(stderr, "%s: cannot allocate the bo\n", test->name);
+			goto done;
+		}
+
+		/* the first map has the widest usage, the others only ref it */
+		if (test->flags & BENCH_MAPPED) {
+			if (!bufmgr->backend->bo_map(shared, TBM_DEVICE_CPU,
+										 TBM_OPTION_READ | TBM_OPTION_WRITE).ptr) {
+				fprintf(stderr, "%s: cannot map the bo\n", test->name);
+				goto done;
+			}
+			mapped = 1;
+		}
+	}
+
+	for (i = 0; i < opts->threads; i++) {
+		threads[i].test = test;
+		threads[i].opts = opts;
+		threads[i].bufmgr = bufmgr;
+		threads[i].barrier = &barrier;
+		threads[i].samples = samples + (size_t)opts->iterations * i;
+		threads[i].bo = shared;
+
+		if (test->flags & BENCH_BO) {
+			threads[i].bo = bench_bo_alloc(bufmgr, opts->width, opts->height,
+										   opts->format, TBM_BO_DEFAULT);
+			if (!threads[i].bo) {
+				fprintf(stderr, "%s: cannot allocate the bo\n", test->name);
+				goto done;
+			}
+
+			if ((test->flags & BENCH_PERSISTENT) &&
+				!tbm_android_bo_set_persistent(threads[i].bo, 1)) {
+				fprintf(stderr, "%s: cannot keep the mapping\n", test->name);
+				goto done;
+			}
+		}
+
+		if (test->flags & BENCH_SRC) {
+			threads[i].src = bench_bo_alloc(bufmgr, opts->width, opts->height,
+											opts->format, TBM_BO_DEFAULT);
+			if (!threads[i].src) {
+				fprintf(stderr, "%s: cannot allocate the bo\n", test->name);
+				goto done;
+			}
+		}
+	}
+
+	has_counters = _gralloc_counters(&before);
+	fds = _count_fds();
+
+	pthread_barrier_init(&barrier, NULL, opts->threads + 1);
+
+	for (; started < opts->threads; started++) {
+		if (pthread_create(&threads[started].thread, NULL, _bench_thread,
+						   &threads[started])) {
+			fprintf(stderr, "%s: cannot create the thread\n", test->name);
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < opts->threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	pthread_barrier_destroy(&barrier);
+
+	_gralloc_counters(&after);
+
+	if (mapped) {
+		bufmgr->backend->bo_unmap(shared);
+		mapped = 0;
+	}
+
+	/*
+	 * The bo keeps the fence of its last unmap. The fds are counted before
+	 * the bos are freed, the pool keeps only a few of the freed buffers.
+	 */
+	for (i = 0; i < opts->threads; i++) {
+		int fence;
+
+		if (threads[i].bo) {
+			fence = tbm_android_bo_get_release_fence(threads[i].bo);
+			if (fence >= 0)
+				close(fence);
+		}
+		if (threads[i].src) {
+			fence = tbm_android_bo_get_release_fence(threads[i].src);
+			if (fence >= 0)
+				close(fence);
+		}
+	}
+
+	fds = _count_fds() - fds;
+
+	if ((test->flags & BENCH_BYTES) && threads[0].bo)
+		bytes = bufmgr->backend->bo_size(threads[0].bo);
+
+	for (i = 0; i < opts->threads; i++) {
+		if (threads[i].bo && threads[i].bo != shared)
+			bench_bo_unref(threads[i].bo);
+		if (threads[i].src)
+			bench_bo_unref(threads[i].src);
+		threads[i].bo = NULL;
+		threads[i].src = NULL;
+	}
+
+	if (shared) {
+		bench_bo_unref(shared);
+		shared = NULL;
+	}
+
+	start = threads[0].start;
+	end = threads[0].end;
+
+	for (i = 0; i < opts->threads; i++) {
+		if (threads[i].failed) {
+			fprintf(stderr, "%s: the call failed\n", test->name);
+			goto done;
+		}
+		if (threads[i].start < start)
+			start = threads[i].start;
+		if (threads[i].end > end)
+			end = threads[i].end;
+	}
+
+	count = (size_t)opts->iterations * opts->threads;
+	qsort(samples, count, sizeof(uint64_t), _cmp_u64);
+
+	printf("%-18s %7d %9zu %12.0f %9.2f %9.2f %9.2f %9.2f\n", test->name,
+		   opts->threads, count, count * 1e9 / (end > start ? end - start : 1),
+		   _percentile_us(samples, count, 50),
+		   _percentile_us(samples, count, 90),
+		   _percentile_us(samples, count, 99),
+		   samples[count - 1] / 1000.0);
+
+	ret = 1;
+
+	if (bytes)
+		printf("%-18s %d bytes per call, %.0f MB/s\n", "", bytes,
+			   (double)bytes * count * 1e3 / (end > start ? end - start : 1));
+
+	if (has_counters) {
+		printf("%-18s gralloc allocs:%llu frees:%llu registers:%llu "
+			   "unregisters:%llu locks:%llu unlocks:%llu errors:%llu\n", "",
+			   (unsigned long long)(after.allocs - before.allocs),
+			   (unsigned long long)(after.frees - before.frees),
+			   (unsigned long long)(after.registers - before.registers),
+			   (unsigned long long)(after.unregisters - before.unregisters),
+			   (unsigned long long)(after.locks - before.locks),
+			   (unsigned long long)(after.unlocks - before.unlocks),
+			   (unsigned long long)(after.errors - before.errors));
+		printf("%-18s gralloc async locks:%llu unlocks:%llu, fences:%llu\n",
+			   "", (unsigned long long)(after.async_locks - before.async_locks),
+			   (unsigned long long)(after.async_unlocks - before.async_unlocks),
+			   (unsigned long long)(after.fences - before.fences));
+
+		ret = after.errors == before.errors;
+	}
+
+	/* the reclaim worker may trim the pool meanwhile, so the buffers of the
+	 * earlier tests can close their fds, only the new ones are the leaks */
+	if ((test->flags & BENCH_NO_FDS) && fds > 0) {
+		fprintf(stderr, "%s: %d fds are left open\n", test->name, fds);
+		ret = 0;
+	}
+
+done:
+	if (threads) {
+		for (i = 0; i < opts->threads; i++) {
+			if (threads[i].bo && threads[i].bo != shared)
+				bench_bo_unref(threads[i].bo);
+			if (threads[i].src)
+				bench_bo_unref(threads[i].src);
+		}
+	}
+
+	if (mapped)
+		bufmgr->backend->bo_unmap(shared);
+	if (shared)
+		bench_bo_unref(shared);
+
+	free(samples);
+	free(threads);
+
+	return ret;
+}
+
+static void
+_usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-w width] [-h height] [-f fourcc] "
+			"[-n iterations] [-t threads] [-s] [-a acquire fence us] [-l] "
+			"[test ...]\n", prog);
+	fprintf(stderr, "The tests:\n");
+	for (i = 0; i < NUM_TESTS; i++)
+		fprintf(stderr, "  %-18s %s\n", tests[i].name, tests[i].desc);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_opts opts = { 1920, 1080, TBM_FORMAT_ARGB8888, 10000, 1, 0, 0,
+							   NULL, 0 };
+	struct bench_opts run;
+	tbm_bufmgr bufmgr;
+	tbm_bo bo;
+	int opt, i, j, ret = 0;
+
+	while ((opt = getopt(argc, argv, "w:h:f:n:t:sa:l")) != -1) {
+		switch (opt) {
+		case 'w':
+			opts.width = atoi(optarg);
+			break;
+		case 'h':
+			opts.height = atoi(optarg);
+			break;
+		case 'f':
+			if (strlen(optarg) != 4) {
+				_usage(argv[0]);
+				return 1;
+			}
+			opts.format = __tbm_fourcc_code(optarg[0], optarg[1], optarg[2],
+											optarg[3]);
+			break;
+		case 'n':
+			opts.iterations = atoi(optarg);
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 's':
+			opts.scale = 1;
+			break;
+		case 'a':
+			opts.fence_us = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+		default:
+			_usage(argv[0]);
+			return opt != 'l';
+		}
+	}
+
+	if (opts.width <= 0 || opts.height <= 0 || opts.iterations <= 0 ||
+		opts.threads <= 0) {
+		_usage(argv[0]);
+		return 1;
+	}
+
+	bufmgr = bench_bufmgr_init();
+	if (!bufmgr)
+		return 1;
+
+	/* the gralloc is loaded at the first allocation, not in the first test */
+	bo = bench_bo_alloc(bufmgr, opts.width, opts.height, opts.format,
+						TBM_BO_DEFAULT);
+	if (!bo) {
+		fprintf(stderr, "cannot allocate the surface\n");
+		bench_bufmgr_deinit(bufmgr);
+		return 1;
+	}
+	bench_bo_unref(bo);
+
+	if (!bufmgr->backend->surface_supported_format(&opts.formats,
+												   &opts.num_formats)) {
+		fprintf(stderr, "cannot get the supported formats\n");
+		bench_bufmgr_deinit(bufmgr);
+		return 1;
+	}
+
+	printf("%dx%d, format:%c%c%c%c, %d iterations per thread\n", opts.width,
+		   opts.height, opts.format & 0xff, (opts.format >> 8) & 0xff,
+		   (opts.format >> 16) & 0xff, (opts.format >> 24) & 0xff,
+		   opts.iterations);
+	printf("%-18s %7s %9s %12s %9s %9s %9s %9s\n", "test", "threads", "calls",
+		   "calls/s", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+	for (i = 0; i < NUM_TESTS; i++) {
+		if (optind < argc) {
+			for (j = optind; j < argc; j++) {
+				if (!strcmp(argv[j], tests[i].name))
+					break;
+			}
+			if (j == argc)
+				continue;
+		}
+
+		run = opts;
+		run.threads = opts.scale ? 1 : opts.threads;
+
+		for (;;) {
+			if (!_bench_run(bufmgr, &tests[i], &run))
+				ret = 1;
+			if (run.threads >= opts.threads)
+				break;
+			run.threads = run.threads * 2 < opts.threads ? run.threads * 2 :
+														   opts.threads;
+		}
+	}
+
+	free(opts.formats);
+	bench_bufmgr_deinit(bufmgr);
+
+	return ret;
+}
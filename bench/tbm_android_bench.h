@@ -0,0 +1,85 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifndef _TBM_ANDROID_BENCH_H_
+#define _TBM_ANDROID_BENCH_H_
+
+#include <pthread.h>
+#include <tbm_bufmgr.h>
+#include <tbm_bufmgr_backend.h>
+
+/*
+ * The host of the backend in the benchmark: the part of libtbm the backend
+ * calls back and the bo bookkeeping libtbm does around it. The imported
+ * bos are shared by their backend private as libtbm does, so the import
+ * cache of the backend sees the same calls as under libtbm.
+ */
+
+struct _tbm_bufmgr {
+	tbm_bufmgr_backend backend;
+	pthread_mutex_t lock;
+	struct _tbm_bo *bos;          /* the live bos */
+};
+
+struct _tbm_bo {
+	struct _tbm_bufmgr *bufmgr;
+	void *priv;
+	int ref_cnt;
+	struct _tbm_bo *next;
+};
+
+/**
+ * @brief load the backend into a new bufmgr.
+ * @return the bufmgr or NULL in an error case.
+ */
+tbm_bufmgr
+bench_bufmgr_init(void);
+
+void
+bench_bufmgr_deinit(tbm_bufmgr bufmgr);
+
+/* @brief allocate the surface bo, NULL in an error case */
+tbm_bo
+bench_bo_alloc(tbm_bufmgr bufmgr, int width, int height, int format, int flags);
+
+/* @brief import the native handle, the live bo of the buffer gets a ref */
+tbm_bo
+bench_bo_import(tbm_bufmgr bufmgr, const void *native);
+
+/* @brief import the tbm_fd, the live bo of the buffer gets a ref */
+tbm_bo
+bench_bo_import_fd(tbm_bufmgr bufmgr, tbm_fd fd);
+
+/* @brief drop the ref, the last one frees the bo in the backend */
+void
+bench_bo_unref(tbm_bo bo);
+
+#endif /* _TBM_ANDROID_BENCH_H_ */
@@ -0,0 +1,238 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fake_gralloc.h"
+#include "tbm_android_bench.h"
+
+extern const TBMModuleData tbmModuleData;
+
+tbm_bufmgr_backend
+tbm_backend_alloc(void)
+{
+	return calloc(1, sizeof(struct _tbm_bufmgr_backend));
+}
+
+void
+tbm_backend_free(tbm_bufmgr_backend backend)
+{
+	free(backend);
+}
+
+int
+tbm_backend_init(tbm_bufmgr bufmgr, tbm_bufmgr_backend backend)
+{
+	bufmgr->backend = backend;
+
+	return 1;
+}
+
+void *
+tbm_backend_get_bufmgr_priv(tbm_bo bo)
+{
+	return bo->bufmgr->backend->priv;
+}
+
+void *
+tbm_backend_get_priv_from_bufmgr(tbm_bufmgr bufmgr)
+{
+	return bufmgr->backend->priv;
+}
+
+void *
+tbm_backend_get_bo_priv(tbm_bo bo)
+{
+	return bo->priv;
+}
+
+/* the backend opens the stand-in gralloc unless TBM_BACKEND_GRALLOC is set */
+int
+hw_get_module(const char *id, const struct hw_module_t **module)
+{
+	if (strcmp(id, GRALLOC_HARDWARE_MODULE_ID))
+		return -ENOENT;
+
+	*module = &HAL_MODULE_INFO_SYM.common;
+
+	return 0;
+}
+
+tbm_bufmgr
+bench_bufmgr_init(void)
+{
+	tbm_bufmgr bufmgr;
+
+	bufmgr = calloc(1, sizeof(*bufmgr));
+	if (!bufmgr)
+		return NULL;
+
+	pthread_mutex_init(&bufmgr->lock, NULL);
+
+	if (!tbmModuleData.init(bufmgr, -1)) {
+		fprintf(stderr, "cannot initialize the backend\n");
+		pthread_mutex_destroy(&bufmgr->lock);
+		free(bufmgr);
+		return NULL;
+	}
+
+	return bufmgr;
+}
+
+void
+bench_bufmgr_deinit(tbm_bufmgr bufmgr)
+{
+	while (bufmgr->bos) {
+		fprintf(stderr, "bo:%p is leaked\n", bufmgr->bos);
+		bufmgr->bos->ref_cnt = 1;
+		bench_bo_unref(bufmgr->bos);
+	}
+
+	bufmgr->backend->bufmgr_deinit(bufmgr->backend->priv);
+	tbm_backend_free(bufmgr->backend);
+
+	pthread_mutex_destroy(&bufmgr->lock);
+	free(bufmgr);
+}
+
+/*
+ * Like libtbm, the bufmgr lock is held over the backend call, so the private
+ * handed out again by the import cache can't be freed meanwhile.
+ */
+enum {
+	BENCH_BO_ALLOC,
+	BENCH_BO_IMPORT,
+	BENCH_BO_IMPORT_FD,
+};
+
+/* gets the bo from the backend, or refs the live bo of the same private */
+static tbm_bo
+_bench_bo_get(tbm_bufmgr bufmgr, int how, const void *native, tbm_fd fd,
+			  int width, int height, int format, int flags)
+{
+	tbm_bufmgr_backend backend = bufmgr->backend;
+	tbm_bo bo, bo2;
+	void *priv = NULL;
+
+	bo = calloc(1, sizeof(*bo));
+	if (!bo)
+		return NULL;
+
+	bo->bufmgr = bufmgr;
+
+	pthread_mutex_lock(&bufmgr->lock);
+
+	switch (how) {
+	case BENCH_BO_ALLOC:
+		priv = backend->surface_bo_alloc(bo, width, height, format, flags, 0);
+		break;
+	case BENCH_BO_IMPORT:
+		priv = backend->bo_import_(bo, native);
+		break;
+	case BENCH_BO_IMPORT_FD:
+		priv = backend->bo_import_fd(bo, fd);
+		break;
+	}
+
+	if (!priv) {
+		pthread_mutex_unlock(&bufmgr->lock);
+		free(bo);
+		return NULL;
+	}
+
+	for (bo2 = bufmgr->bos; bo2; bo2 = bo2->next) {
+		if (bo2->priv == priv) {
+			bo2->ref_cnt++;
+			pthread_mutex_unlock(&bufmgr->lock);
+			free(bo);
+			return bo2;
+		}
+	}
+
+	bo->priv = priv;
+	bo->ref_cnt = 1;
+	bo->next = bufmgr->bos;
+	bufmgr->bos = bo;
+
+	pthread_mutex_unlock(&bufmgr->lock);
+
+	return bo;
+}
+
+tbm_bo
+bench_bo_alloc(tbm_bufmgr bufmgr, int width, int height, int format, int flags)
+{
+	return _bench_bo_get(bufmgr, BENCH_BO_ALLOC, NULL, -1, width, height,
+						 format, flags);
+}
+
+tbm_bo
+bench_bo_import(tbm_bufmgr bufmgr, const void *native)
+{
+	return _bench_bo_get(bufmgr, BENCH_BO_IMPORT, native, -1, 0, 0, 0, 0);
+}
+
+tbm_bo
+bench_bo_import_fd(tbm_bufmgr bufmgr, tbm_fd fd)
+{
+	return _bench_bo_get(bufmgr, BENCH_BO_IMPORT_FD, NULL, fd, 0, 0, 0, 0);
+}
+
+void
+bench_bo_unref(tbm_bo bo)
+{
+	tbm_bufmgr bufmgr = bo->bufmgr;
+	tbm_bo *link;
+
+	pthread_mutex_lock(&bufmgr->lock);
+
+	if (--bo->ref_cnt > 0) {
+		pthread_mutex_unlock(&bufmgr->lock);
+		return;
+	}
+
+	for (link = &bufmgr->bos; *link != bo; link = &(*link)->next)
+		;
+	*link = bo->next;
+
+	bufmgr->backend->bo_free(bo);
+
+	pthread_mutex_unlock(&bufmgr->lock);
+
+	free(bo);
+}
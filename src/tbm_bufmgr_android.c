@@ -35,6 +35,24 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <tbm_bufmgr_backend.h>
 #include <tbm_surface.h>
@@ -43,6 +61,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
 
+#include "tbm_bufmgr_android.h"
+
 #define DEBUG
 #ifdef DEBUG
 int bDebug = 0;
@@ -117,6 +137,9 @@ int bDlog;
 									  __func__, __LINE__, ##__VA_ARGS__)
 #endif /* HAVE_DLOG */
 
+/* keep the bos locked for the cpu access between the maps by default */
+static int bPersistentMap;
+
 /* check condition */
 #define ANDROID_RETURN_IF_FAIL(cond) {\
 	if (!(cond)) {\
@@ -134,45 +157,146 @@ int bDlog;
 
 /* this macros has been copied from a gralloc implementation */
 #define ALIGN(x, a)       (((x) + (a) - 1) & ~((a) - 1))
+#define MIN(a, b)         ((a) < (b) ? (a) : (b))
+
+/*
+ * NV12 isn't a standard android format, the vendors define it by themselves
+ * in the gralloc private headers.
+ */
+#if defined(QCOM_BSP)
+#define ANDROID_HAL_PIXEL_FORMAT_NV12 0x109 /* HAL_PIXEL_FORMAT_YCbCr_420_SP */
+#elif defined(EXYNOS4_ENHANCEMENTS)
+#define ANDROID_HAL_PIXEL_FORMAT_NV12 0x105 /* HAL_PIXEL_FORMAT_YCbCr_420_SP */
+#endif
+
+/* the conversion of the cpu access to the format gralloc can't allocate */
+enum {
+	ANDROID_SWIZZLE_NONE = 0,
+	ANDROID_SWIZZLE_RB565,   /* the red and blue of a 16 bit pixel swap places */
+	ANDROID_SWIZZLE_OPAQUE,  /* the unused byte becomes the opaque alpha */
+};
+
+/* the description of the buffer format */
+struct _tbm_android_format_desc {
+	uint32_t tbm_format;
+	int android_format;
+	int bpp;              /* bytes per pixel, of the luma plane for yuv */
+	int num_planes;       /* 3 - Y, Cr, Cb planes, 2 - Y and CrCb/CbCr planes */
+	int chroma_swap;      /* the tbm format orders the chroma planes reversely */
+	int swizzle;          /* ANDROID_SWIZZLE_*, the cpu maps a shadow buffer */
+};
 
 /*
  * Android to Tizen buffer formats map. (and vice versa)
  *
  * The formats set we currently support.
  * At this stage, we use formats that have a full match with Android formats.
- * In the future, we need to increase the number of matching formats.*/
+ * In the future, we need to increase the number of matching formats.
+ *
+ *  - TBM_FORMAT_YUV420 is allocated as HAL_PIXEL_FORMAT_YV12, they differ
+ * only by the order of the chroma planes, which is swapped by the plane
+ * data query. The first row of an android format gives its tbm format.
+ *  - the little-endian drm formats ABGR8888, XBGR8888, ARGB8888 and BGR888
+ * have the same bytes in memory as RGBA_8888, RGBX_8888, BGRA_8888 and
+ * RGB_888, so they are allocated as those without any conversion.
+ *  - gralloc has no BGRX and BGR565, so XRGB8888 and BGR565 are allocated as
+ * BGRA_8888 and RGB_565 and the cpu maps a converted shadow of the buffer.
+ *
+ * The layout of the surfaces is computed from this table, so a new format
+ * needs only a new row.*/
 
-static const uint32_t android_tizen_formats_map[][2] =
+static const struct _tbm_android_format_desc android_tizen_formats[] =
 {
-	{ HAL_PIXEL_FORMAT_RGBA_8888, TBM_FORMAT_RGBA8888 },
-	{ HAL_PIXEL_FORMAT_RGBX_8888, TBM_FORMAT_RGBX8888 },
-	{ HAL_PIXEL_FORMAT_RGB_888,   TBM_FORMAT_RGB888 },
-	{ HAL_PIXEL_FORMAT_RGB_565,   TBM_FORMAT_RGB565 },
-	{ HAL_PIXEL_FORMAT_BGRA_8888, TBM_FORMAT_BGRA8888 },
-	{ HAL_PIXEL_FORMAT_RGBA_4444, TBM_FORMAT_RGBA4444 }
+	{ .tbm_format = TBM_FORMAT_RGBA8888, .android_format = HAL_PIXEL_FORMAT_RGBA_8888,
+	  .bpp = 4, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_RGBX8888, .android_format = HAL_PIXEL_FORMAT_RGBX_8888,
+	  .bpp = 4, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_RGB888, .android_format = HAL_PIXEL_FORMAT_RGB_888,
+	  .bpp = 3, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_RGB565, .android_format = HAL_PIXEL_FORMAT_RGB_565,
+	  .bpp = 2, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_BGRA8888, .android_format = HAL_PIXEL_FORMAT_BGRA_8888,
+	  .bpp = 4, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_RGBA4444, .android_format = HAL_PIXEL_FORMAT_RGBA_4444,
+	  .bpp = 2, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_YVU420, .android_format = HAL_PIXEL_FORMAT_YV12,
+	  .bpp = 1, .num_planes = 3 },
+	{ .tbm_format = TBM_FORMAT_YUV420, .android_format = HAL_PIXEL_FORMAT_YV12,
+	  .bpp = 1, .num_planes = 3, .chroma_swap = 1 },
+	{ .tbm_format = TBM_FORMAT_NV21, .android_format = HAL_PIXEL_FORMAT_YCrCb_420_SP,
+	  .bpp = 1, .num_planes = 2 },
+#ifdef ANDROID_HAL_PIXEL_FORMAT_NV12
+	{ .tbm_format = TBM_FORMAT_NV12, .android_format = ANDROID_HAL_PIXEL_FORMAT_NV12,
+	  .bpp = 1, .num_planes = 2 },
+#endif
+	{ .tbm_format = TBM_FORMAT_ABGR8888, .android_format = HAL_PIXEL_FORMAT_RGBA_8888,
+	  .bpp = 4, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_XBGR8888, .android_format = HAL_PIXEL_FORMAT_RGBX_8888,
+	  .bpp = 4, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_ARGB8888, .android_format = HAL_PIXEL_FORMAT_BGRA_8888,
+	  .bpp = 4, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_BGR888, .android_format = HAL_PIXEL_FORMAT_RGB_888,
+	  .bpp = 3, .num_planes = 1 },
+	{ .tbm_format = TBM_FORMAT_XRGB8888, .android_format = HAL_PIXEL_FORMAT_BGRA_8888,
+	  .bpp = 4, .num_planes = 1, .swizzle = ANDROID_SWIZZLE_OPAQUE },
+	{ .tbm_format = TBM_FORMAT_BGR565, .android_format = HAL_PIXEL_FORMAT_RGB_565,
+	  .bpp = 2, .num_planes = 1, .swizzle = ANDROID_SWIZZLE_RB565 },
 };
 
 /* amount of map rows */
-#define ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT sizeof(android_tizen_formats_map)/sizeof(uint32_t)/2
+#define ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT \
+	(sizeof(android_tizen_formats) / sizeof(android_tizen_formats[0]))
+
+/*
+ * The formats are looked up on every alloc, import and plane data query,
+ * so both directions are hashed into open addressing tables of the row
+ * indexes (+1, 0 is an empty slot). The tables are built once.
+ */
+#define ANDROID_FORMAT_HASH_BITS 5
+#define ANDROID_FORMAT_HASH_SIZE (1 << ANDROID_FORMAT_HASH_BITS)
+#define ANDROID_FORMAT_HASH(key) \
+	(((uint32_t)(key) * 2654435761u) >> (32 - ANDROID_FORMAT_HASH_BITS))
+
+static uint8_t formats_by_tbm[ANDROID_FORMAT_HASH_SIZE];
+static uint8_t formats_by_android[ANDROID_FORMAT_HASH_SIZE];
+static pthread_once_t formats_once = PTHREAD_ONCE_INIT;
 
 /*
- * Android to Tizen flags map. (and vice versa)
+ * Tizen to Android flags map.
  *
- *  - for the TBM_BO_SCANOUT flag we use the additional flag
- * GRALLOC_USAGE_HW_COMPOSER, because the buffer will be used by the
- * Hardware Composer.
+ *  - for the TBM_BO_SCANOUT flag we use the additional flags
+ * GRALLOC_USAGE_HW_COMPOSER and GRALLOC_USAGE_HW_RENDER, because the buffer
+ * will be used by the Hardware Composer.
+ *  - for the TBM_BO_NONCACHABLE and TBM_BO_WC flags we ask for the rare cpu
+ * access, the gralloc allocates such buffers uncached (write-combined).
+ *
+ * The usage of every combination of the flags is precomputed, the row is
+ * the tbm flags masked with ANDROID_TBM_FLAGS_MASK.
  */
+#define ANDROID_TBM_FLAGS_MASK (TBM_BO_SCANOUT | TBM_BO_NONCACHABLE | TBM_BO_WC)
+
+#define ANDROID_USAGE_SCANOUT \
+	(GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_HW_RENDER)
+#define ANDROID_USAGE_SW_CACHED \
+	(GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN)
+#define ANDROID_USAGE_SW_UNCACHED \
+	(GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_RARELY)
 
-static const uint32_t android_tizen_flags_map[][2] =
+static const uint32_t tizen_android_flags_map[ANDROID_TBM_FLAGS_MASK + 1] =
 {
-	{ GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_SW_READ_OFTEN, TBM_BO_DEFAULT },
-	{ GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_SW_WRITE_OFTEN |
-		GRALLOC_USAGE_HW_RENDER, TBM_BO_SCANOUT }
+	[TBM_BO_DEFAULT] = ANDROID_USAGE_SW_CACHED,
+	[TBM_BO_SCANOUT] = ANDROID_USAGE_SCANOUT | GRALLOC_USAGE_SW_WRITE_OFTEN,
+	[TBM_BO_NONCACHABLE] = ANDROID_USAGE_SW_UNCACHED,
+	[TBM_BO_SCANOUT | TBM_BO_NONCACHABLE] =
+		ANDROID_USAGE_SCANOUT | ANDROID_USAGE_SW_UNCACHED,
+	[TBM_BO_WC] = ANDROID_USAGE_SW_UNCACHED,
+	[TBM_BO_SCANOUT | TBM_BO_WC] =
+		ANDROID_USAGE_SCANOUT | ANDROID_USAGE_SW_UNCACHED,
+	[TBM_BO_NONCACHABLE | TBM_BO_WC] = ANDROID_USAGE_SW_UNCACHED,
+	[TBM_BO_SCANOUT | TBM_BO_NONCACHABLE | TBM_BO_WC] =
+		ANDROID_USAGE_SCANOUT | ANDROID_USAGE_SW_UNCACHED,
 };
 
-/* amount of map rows */
-#define ANDROID_TIZEN_FLAGS_MAP_ROWS_CNT sizeof(android_tizen_flags_map)/sizeof(uint32_t)/2
-
 char *STR_DEVICE[] = {
 	"DEF",
 	"CPU",
@@ -191,24 +315,320 @@ char *STR_OPT[] = {
 typedef struct _tbm_bufmgr_android *tbm_bufmgr_android;
 typedef struct _tbm_bo_android *tbm_bo_android;
 
+/* the maximal amount of the planes of the surface */
+#define ANDROID_MAX_PLANES 3
+
+/* the memory layout of the surface, the planes are in the android order */
+struct _tbm_android_layout {
+	uint32_t size;        /* size of the whole surface */
+	int num_planes;
+	uint32_t offset[ANDROID_MAX_PLANES];
+	uint32_t pitch[ANDROID_MAX_PLANES];
+	uint32_t plane_size[ANDROID_MAX_PLANES];
+};
+
+/* the rectangle of the surface */
+struct _tbm_android_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/*
+ * identity of an imported native buffer: the inode of its first fd and
+ * the ints of the handle (the old kernels give all dma-bufs one inode).
+ */
+struct _tbm_android_import_key {
+	dev_t dev;
+	ino_t ino;
+	int num_fds;
+	int num_ints;
+	uint64_t ints_hash;
+};
+
 /* tbm buffer object for android */
 struct _tbm_bo_android {
+	tbm_bufmgr_android bufmgr_android; /* the owner, for the stats */
 	buffer_handle_t handler;
 	int width;
 	int height;
-	void *pBase;          /* virtual address */
-	unsigned int map_cnt;
+	int stride;           /* in pixels, as gralloc returned it */
+	int format_tbm;
+	int format_android;
+	int flags_android;
+	int imported;         /* the handler belongs to another process */
+	int owns_handle;      /* the handler is rebuilt from the fd or is the heap's */
+	int heap;             /* ANDROID_HEAP_KIND_* of the heap engine buffer or 0 */
+	void *heap_map;       /* the mapping of the heap engine buffer, under the lock */
+	void *wrap_ptr;       /* the wrapped user memory, the bo has no handler */
+	void *wrap_map;       /* wrap_ptr if the memory is mapped from the fd */
+	uint32_t wrap_size;
+	int wrap_fd;          /* the dup of the wrapped fd or -1, with wrap_map */
+	void (*wrap_release)(void *data);
+	void *wrap_data;
+	struct _tbm_android_import_key import_key;
+	int import_cached;    /* the bo is in the import cache */
+	struct _tbm_bo_android *import_next;        /* by the key */
+	struct _tbm_bo_android *import_handle_next; /* by the handle pointer */
+	struct _tbm_bo_android *slab_next; /* link of the slab free list */
+	void *pBase;          /* virtual address, accessed atomically */
+	int lock_usage;       /* usage the buffer is locked with, accessed atomically */
+	int lock_full;        /* the whole buffer is locked, accessed atomically */
+	int persistent;       /* stays locked after the last unmap, under the lock */
+	struct _tbm_android_rect lock_rect; /* the locked region */
+	int swizzle;          /* ANDROID_SWIZZLE_*, the format gralloc can't allocate */
+	void *shadow;         /* the converted copy the cpu maps, under the lock */
+	int shadow_valid;     /* the shadow is filled from the locked buffer */
+	int shadow_dirty;     /* the shadow is mapped for writing, to be stored */
+	int acquire_fence;    /* to be waited before the next cpu access, or -1 */
+	int release_fence;    /* signalled when the last cpu access is done, or -1 */
+	unsigned int map_cnt; /* accessed atomically */
+	pthread_mutex_t lock; /* serializes the first map and the last unmap */
 	unsigned int flags_tbm;
+	struct _tbm_android_layout layout;
+};
+
+/* default limits of the recycling pool, can be changed by the env variables */
+#define ANDROID_POOL_BUCKET_MAX_DEFAULT  3
+#define ANDROID_POOL_BYTES_MAX_DEFAULT   (32 * 1024 * 1024)
+#define ANDROID_POOL_IDLE_MS_DEFAULT     2000
+
+/* a freed gralloc buffer kept for the reuse */
+struct _tbm_android_pool_entry {
+	buffer_handle_t handler;
+	int stride;
 	uint32_t size;
+	uint64_t stamp;       /* time the buffer has been put to the pool, ms */
+	int prewarmed;        /* allocated by the prewarm, never idle */
+	struct _tbm_android_pool_entry *next;
+};
+
+/* buffers which can replace each other, most recently freed first */
+struct _tbm_android_pool_bucket {
+	int width;
+	int height;
+	int format_android;
+	int flags_android;
+	unsigned int cnt;
+	struct _tbm_android_pool_entry *entries;
+	struct _tbm_android_pool_bucket *next;
+};
+
+/* recycling pool of the freed gralloc buffers */
+struct _tbm_android_pool {
+	pthread_mutex_t lock;
+	struct _tbm_android_pool_bucket *buckets;
+	unsigned int bucket_max;   /* 0 - the pool is disabled */
+	uint64_t bytes_max;
+	unsigned int idle_ms;      /* 0 - buffers never become idle */
+	uint64_t bytes;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long prewarmed;
+	unsigned long prewarmed_used;
+};
+
+#define ANDROID_IMPORT_CACHE_SIZE 64
+
+/*
+ * The imported bos, a native buffer imported again gets the same bo.
+ * libtbm finds its bo by the returned private and only references it, so
+ * the cache holds no references: the bo leaves it when libtbm frees it.
+ */
+struct _tbm_android_import_cache {
+	pthread_mutex_t lock;
+	struct _tbm_bo_android *bos[ANDROID_IMPORT_CACHE_SIZE];
+	struct _tbm_bo_android *bos_by_handle[ANDROID_IMPORT_CACHE_SIZE];
+
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* default depth of the reclaim queue, can be changed by the env variable */
+#define ANDROID_RECLAIM_DEPTH_DEFAULT 32
+
+/* the polling period of the reclaim worker if its semaphore fails */
+#define ANDROID_RECLAIM_BACKOFF_US 10000
+
+/* a freed gralloc buffer waiting for the reclaim worker */
+struct _tbm_android_reclaim_entry {
+	buffer_handle_t handler;
+	struct _tbm_android_reclaim_entry *next;
+};
+
+/* the worker releasing the freed gralloc buffers off the caller's thread,
+ * it also trims the idle buffers out of the pool */
+struct _tbm_android_reclaim {
+	int enabled;               /* the freed buffers are queued */
+	int running;               /* the worker is started */
+	unsigned int trim_ms;      /* 0 - the worker doesn't trim the pool */
+	pthread_t thread;
+	sem_t sem;
+	struct _tbm_android_reclaim_entry *head; /* lock-free stack */
+	unsigned int depth;        /* queued buffers, accessed atomically */
+	unsigned int depth_max;
+	int stop;                  /* accessed atomically */
+
+	unsigned long deferred;    /* accessed atomically */
+	unsigned long overflows;   /* accessed atomically */
+	unsigned long batches;     /* accessed by the worker only */
+};
+
+/* amount of the bo privates allocated at once */
+#define ANDROID_SLAB_CHUNK_BOS 64
+/* amount of the free lists, the threads are spread over them */
+#define ANDROID_SLAB_SHARDS_BITS 3
+#define ANDROID_SLAB_SHARDS (1 << ANDROID_SLAB_SHARDS_BITS)
+
+struct _tbm_android_slab_chunk {
+	struct _tbm_android_slab_chunk *next;
+	struct _tbm_bo_android bos[ANDROID_SLAB_CHUNK_BOS];
+};
+
+/* a free list of the bo privates, on its own cache line */
+struct _tbm_android_slab_shard {
+	pthread_mutex_t lock;
+	struct _tbm_bo_android *free_list;
+} __attribute__((aligned(64)));
+
+/* the allocator of the bo privates */
+struct _tbm_android_slab {
+	struct _tbm_android_slab_shard shards[ANDROID_SLAB_SHARDS];
+	pthread_mutex_t lock;            /* guards the chunks */
+	struct _tbm_android_slab_chunk *chunks;
+
+	unsigned long chunk_cnt;
+	unsigned long in_use;            /* accessed atomically */
+	unsigned long peak;              /* accessed atomically */
+	unsigned long allocs;            /* accessed atomically */
+};
+
+/* the most surface kinds the prewarm profile can list */
+#define ANDROID_PREWARM_MAX 16
+
+/* the surfaces allocated into the pool at the startup */
+struct _tbm_android_prewarm_item {
+	int width;
+	int height;
+	int android_format;
+	int android_flags;
+	int count;
+};
+
+struct _tbm_android_prewarm {
+	int running;
+	pthread_t thread;
+	int stop;                  /* accessed atomically */
+	int cnt;
+	struct _tbm_android_prewarm_item items[ANDROID_PREWARM_MAX];
+};
+
+/*
+ * The heap engine allocates the buffers of the chosen tbm flag sets, which
+ * no display or gpu needs, as the dma-bufs of a dma-heap or, if there is no
+ * dma-heap, as memfds. The cpu maps them directly. Their native handle holds
+ * the fd and the ints below and never leaves the backend, the gpu or the
+ * display would take it for the gralloc's, so they're shared only by the
+ * fd. The handle imported anyway never reaches the gralloc. The ints are the
+ * magic, the
+ * kind, the size and the surface: the width, the height, the android format
+ * and the tbm flags, the width is 0 for the bare buffer imported by the fd.
+ */
+#define ANDROID_HEAP_MAGIC      0x54424d48 /* "TBMH" */
+#define ANDROID_HEAP_NUM_INTS   7
+#define ANDROID_HEAP_DIR        "/dev/dma_heap/"
+#define ANDROID_HEAP_DEFAULT    "system"
+
+enum {
+	ANDROID_HEAP_KIND_MEMFD = 1,
+	ANDROID_HEAP_KIND_DMABUF,
+};
+
+/* the uapi of linux/dma-heap.h and linux/dma-buf.h, the older headers lack it */
+struct _android_dma_heap_allocation_data {
+	uint64_t len;
+	uint32_t fd;
+	uint32_t fd_flags;
+	uint64_t heap_flags;
+};
+
+#define ANDROID_DMA_HEAP_IOCTL_ALLOC \
+	_IOWR('H', 0x0, struct _android_dma_heap_allocation_data)
+
+struct _android_dma_buf_sync {
+	uint64_t flags;
+};
+
+#define ANDROID_DMA_BUF_SYNC_READ  (1 << 0)
+#define ANDROID_DMA_BUF_SYNC_WRITE (2 << 0)
+#define ANDROID_DMA_BUF_SYNC_START (0 << 2)
+#define ANDROID_DMA_BUF_SYNC_END   (1 << 2)
+#define ANDROID_DMA_BUF_IOCTL_SYNC _IOW('b', 0, struct _android_dma_buf_sync)
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS 1034
+#endif
+
+struct _tbm_android_heap {
+	int enabled;
+	unsigned char flag_sets[ANDROID_TBM_FLAGS_MASK + 1]; /* 1 - served by the heap */
+	int heap_fd;                  /* the dma-heap device or -1 to use memfd */
+	unsigned long allocs;         /* accessed atomically */
+	unsigned long memfd_allocs;   /* accessed atomically */
+};
+
+/* the always-on counters, accessed atomically */
+struct _tbm_android_stats_counters {
+	uint64_t live_bos;
+	uint64_t live_bytes;
+	/* by the row of the format table, the last one - the unknown formats */
+	uint64_t format_bytes[ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT + 1];
+	uint64_t flags_bytes[ANDROID_TBM_FLAGS_MASK + 1];
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t imports;
+	uint64_t maps;
+	uint64_t unmaps;
+	uint64_t latency[TBM_ANDROID_STATS_LATENCIES][TBM_ANDROID_STATS_HIST_BUCKETS];
+
+	/* the dump on the signal */
+	int signo;
+	pthread_t thread;
+	sem_t sem;
+	int stop;                     /* accessed atomically */
+	struct sigaction old_action;
 };
 
 /* tbm bufmgr private for android */
 struct _tbm_bufmgr_android {
 	const gralloc_module_t *gralloc_module;
 	alloc_device_t *alloc_dev;
+	void *gralloc_dso;   /* the module loaded by TBM_BACKEND_GRALLOC or NULL */
+	pthread_mutex_t gralloc_lock;
+	int gralloc_state;   /* 0: not loaded yet, 1: opened, -1: failed */
+	/* use lockAsync/unlockAsync of the gralloc module, accessed atomically:
+	 * it's set before any worker starts and may be cleared by the gralloc open */
+	int async_lock;
+	struct _tbm_android_pool pool;
+	struct _tbm_android_import_cache import_cache;
+	struct _tbm_android_slab slab;
+	struct _tbm_android_reclaim reclaim;
+	struct _tbm_android_prewarm prewarm;
+	struct _tbm_android_heap heap;
+	struct _tbm_android_stats_counters stats;
 };
 
 #ifdef QCOM_BSP
+	/* the surface padding library, it's loaded once at the bufmgr init. */
+	static void *libadreno_utils;
+
 	/* link to the surface padding library. */
 	int (*link_adreno_compute_padding)(int width, int bpp,
 									   int surface_tile_height,
@@ -216,506 +636,4532 @@ struct _tbm_bufmgr_android {
 									   int padding_threshold);
 #endif
 
-/* @brief This function can be used to get the match for a @c value from the @c map table.
+/* amount of entries of the surface layout cache, must be a power of two */
+#define ANDROID_LAYOUT_CACHE_SIZE 64
+
+/* the surface layout known for the (width, height, android_format) */
+struct _tbm_android_layout_cache_entry {
+	int valid;
+	int width;
+	int height;
+	int android_format;
+	struct _tbm_android_layout layout;
+};
+
+/*
+ * The cache of the surface layouts.
  *
- * @param[in]: map - the map to find the match in.
- * @param[in]: row_amount - the amount of rows of the map.
- * @param[in]: value - value you're looking the match for.
- * @param[in]: direction - the direction of 'matching', 0 - right to left, otherwise - left to right.
- * @return the match or -1 in an error case.
-*/
-static int32_t
-_get_match(const uint32_t map[][2], uint32_t row_amount, uint32_t value, int direction)
+ * libtbm queries the plane data several times for every surface, so the
+ * computed layouts are kept in a direct-mapped table, the colliding entry
+ * is simply replaced. The layouts gralloc reports for the allocated buffers
+ * replace the estimated ones. The plane data queries don't get the bufmgr,
+ * so the cache is shared by the whole process.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct _tbm_android_layout_cache_entry entries[ANDROID_LAYOUT_CACHE_SIZE];
+	unsigned long hits;
+	unsigned long misses;
+} layout_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t
+_format_key(const struct _tbm_android_format_desc *desc, int by_android)
+{
+	return by_android ? (uint32_t)desc->android_format : desc->tbm_format;
+}
+
+static const struct _tbm_android_format_desc *
+_format_table_find(const uint8_t *table, uint32_t key, int by_android)
+{
+	const struct _tbm_android_format_desc *desc;
+	unsigned int i;
+
+	for (i = ANDROID_FORMAT_HASH(key); table[i];
+		 i = (i + 1) & (ANDROID_FORMAT_HASH_SIZE - 1)) {
+		desc = &android_tizen_formats[table[i] - 1];
+		if (_format_key(desc, by_android) == key)
+			return desc;
+	}
+
+	return NULL;
+}
+
+static void
+_format_table_add(uint8_t *table, unsigned int row, int by_android)
 {
-	int i, direct;
+	uint32_t key = _format_key(&android_tizen_formats[row], by_android);
+	unsigned int i;
 
-	direct = direction ? 0 : 1;
+	/* the earlier row of the same format wins */
+	if (_format_table_find(table, key, by_android))
+		return;
+
+	for (i = ANDROID_FORMAT_HASH(key); table[i];
+		 i = (i + 1) & (ANDROID_FORMAT_HASH_SIZE - 1))
+		;
+
+	table[i] = row + 1;
+}
 
-	for (i = 0; i < row_amount; i++) {
-		if (map[i][direct] == value)
-			return map[i][direct ^ 1];
+static void
+_format_tables_build(void)
+{
+	unsigned int row;
+
+	for (row = 0; row < ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT; row++) {
+		_format_table_add(formats_by_tbm, row, 0);
+		_format_table_add(formats_by_android, row, 1);
 	}
+}
 
-	return -1;
+static const struct _tbm_android_format_desc *
+_get_format_desc_from_tbm(uint32_t tbm_format)
+{
+	pthread_once(&formats_once, _format_tables_build);
+
+	return _format_table_find(formats_by_tbm, tbm_format, 0);
+}
+
+static const struct _tbm_android_format_desc *
+_get_format_desc_from_android(int android_format)
+{
+	pthread_once(&formats_once, _format_tables_build);
+
+	return _format_table_find(formats_by_android, android_format, 1);
 }
 
 static int
 _get_android_format_from_tbm(unsigned int tbm_format)
 {
-	return _get_match(android_tizen_formats_map, ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT, tbm_format, 0);
+	const struct _tbm_android_format_desc *desc;
+
+	desc = _get_format_desc_from_tbm(tbm_format);
+
+	return desc ? desc->android_format : -1;
+}
+
+static int
+_get_tbm_format_from_android(int android_format)
+{
+	const struct _tbm_android_format_desc *desc;
+
+	desc = _get_format_desc_from_android(android_format);
+
+	return desc ? (int)desc->tbm_format : -1;
 }
 
+/*
+ * The android usage doesn't tell write-combined from uncached, both come
+ * back as TBM_BO_NONCACHABLE.
+ */
 static int
 _get_tbm_flags_from_android(int android_flags)
 {
-	return _get_match(android_tizen_flags_map, ANDROID_TIZEN_FLAGS_MAP_ROWS_CNT, android_flags, 1);
+	int tbm_flags = TBM_BO_DEFAULT;
+	int sw_read, sw_write;
+
+	if (android_flags & (GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_HW_FB))
+		tbm_flags |= TBM_BO_SCANOUT;
+
+	/* the cpu accesses the buffer, but nobody asks the gralloc to cache it */
+	sw_read = android_flags & GRALLOC_USAGE_SW_READ_MASK;
+	sw_write = android_flags & GRALLOC_USAGE_SW_WRITE_MASK;
+	if ((sw_read || sw_write) && sw_read != GRALLOC_USAGE_SW_READ_OFTEN &&
+		sw_write != GRALLOC_USAGE_SW_WRITE_OFTEN)
+		tbm_flags |= TBM_BO_NONCACHABLE;
+
+	return tbm_flags;
 }
 
 static int
 _get_android_flags_from_tbm(int tbm_flags)
 {
-	return _get_match(android_tizen_flags_map, ANDROID_TIZEN_FLAGS_MAP_ROWS_CNT, tbm_flags, 0);
+	if (tbm_flags & ~ANDROID_TBM_FLAGS_MASK)
+		DBG("tbm flags 0x%x are ignored", tbm_flags & ~ANDROID_TBM_FLAGS_MASK);
+
+	return tizen_android_flags_map[tbm_flags & ANDROID_TBM_FLAGS_MASK];
+}
+
+#ifdef QCOM_BSP
+static void
+_adreno_utils_init(void)
+{
+	if (libadreno_utils)
+		return;
+
+	libadreno_utils = dlopen("libadreno_utils.so", RTLD_NOW);
+	if (!libadreno_utils) {
+		TBM_LOG_W("Cannot load libadreno_utils.so, surfaces won't be padded");
+		return;
+	}
+
+	*(void **)&link_adreno_compute_padding = dlsym(libadreno_utils,
+												   "compute_surface_padding");
+	if (!link_adreno_compute_padding)
+		TBM_LOG_W("Cannot find compute_surface_padding in libadreno_utils.so");
+}
+
+static void
+_adreno_utils_deinit(void)
+{
+	if (!libadreno_utils)
+		return;
+
+	link_adreno_compute_padding = NULL;
+	dlclose(libadreno_utils);
+	libadreno_utils = NULL;
+}
+#endif
+
+static int
+_is_yuv_format(int android_format)
+{
+	const struct _tbm_android_format_desc *desc;
+
+	desc = _get_format_desc_from_android(android_format);
+
+	return desc && desc->num_planes > 1;
 }
 
 /**
- * @brief get the data of the surface.
- * @note Use NULL pointers on the components you're not interested
- * in: they'll be ignored by the function.
+ * @brief compute the data of the yuv surface.
+ * @note The layouts are the ones the android documentation demands for
+ * HAL_PIXEL_FORMAT_YV12 and the camera HAL_PIXEL_FORMAT_YCrCb_420_SP buffers,
+ * the vendors may differ, so the layout is refined by lock_ycbcr at the first
+ * cpu mapping of the buffer.
+ */
+static int
+_tbm_android_surface_calc_yuv_data(int width, int height,
+								   const struct _tbm_android_format_desc *desc,
+								   int stride, struct _tbm_android_layout *layout)
+{
+	uint32_t y_pitch, c_pitch, y_size, c_size;
+	int c_height = (height + 1) / 2;
+
+	memset(layout, 0x0, sizeof(struct _tbm_android_layout));
+
+	switch (desc->num_planes) {
+	case 3:
+		/* Y plane, then Cr plane, then Cb plane */
+		y_pitch = stride ? stride : ALIGN(width, 16);
+		c_pitch = ALIGN(y_pitch / 2, 16);
+		y_size = y_pitch * height;
+		c_size = c_pitch * c_height;
+
+		layout->num_planes = 3;
+		layout->pitch[0] = y_pitch;
+		layout->plane_size[0] = y_size;
+		layout->offset[1] = y_size;
+		layout->pitch[1] = c_pitch;
+		layout->plane_size[1] = c_size;
+		layout->offset[2] = y_size + c_size;
+		layout->pitch[2] = c_pitch;
+		layout->plane_size[2] = c_size;
+		layout->size = y_size + 2 * c_size;
+		break;
+	case 2:
+		/* Y plane, then the interleaved chroma plane */
+		y_pitch = stride ? stride : width;
+		c_pitch = y_pitch;
+		y_size = y_pitch * height;
+		c_size = c_pitch * c_height;
+
+		layout->num_planes = 2;
+		layout->pitch[0] = y_pitch;
+		layout->plane_size[0] = y_size;
+		layout->offset[1] = y_size;
+		layout->pitch[1] = c_pitch;
+		layout->plane_size[1] = c_size;
+		layout->size = y_size + c_size;
+		break;
+	default:
+		return 0;
+	}
+
+	DBG("width:%d, height:%d, android_format:%d, stride:%d,\n		"
+		"size:%u, y_pitch:%u, c_pitch:%u", width, height,
+		desc->android_format, stride, layout->size, y_pitch, c_pitch);
+
+	return 1;
+}
+
+/**
+ * @brief convert the plane @c plane_idx of the tbm format to the index of
+ * the plane in the android layout.
+ */
+static int
+_get_android_plane_idx(unsigned int tbm_format, int plane_idx)
+{
+	const struct _tbm_android_format_desc *desc;
+
+	/* e.g. YV12 stores Cr before Cb, YUV420 wants Cb first */
+	desc = _get_format_desc_from_tbm(tbm_format);
+	if (desc && desc->chroma_swap && plane_idx > 0)
+		return desc->num_planes - plane_idx;
+
+	return plane_idx;
+}
+
+/**
+ * @brief compute the data of the surface.
  * @param[in] width : the width of the surface
  * @param[in] height : the height of the surface
  * @param[in] android_format : the android_format of the surface
- * @param[out] size : the size of the surface
- * @param[out] pitch : the pitch of the surface
+ * @param[in] stride : the stride in pixels gralloc has returned for the
+ * surface, 0 if it isn't known and has to be estimated
+ * @param[out] layout : the layout of the surface
  * @return 1 if this function succeeds, otherwise 0.
  */
 static int
-_tbm_android_surface_get_data(int width, int height, int android_format,
-							  uint32_t *size, uint32_t *pitch)
+_tbm_android_surface_calc_data(int width, int height, int android_format,
+							   int stride, struct _tbm_android_layout *layout)
 {
-	/* function heavily inspired by the gralloc */
+	const struct _tbm_android_format_desc *desc;
 	/* bpp is bytes per pixel */
-	size_t bpr;
-	int bpp, vstride;
+	uint32_t bpr;
+	int bpp;
 #ifdef QCOM_BSP
-	void *libadreno_utils; /* Pointer to the padding library.*/
 	int surface_tile_height = 1;   /* Linear surface */
 	int raster_mode         = 0;   /* Adreno unknown raster mode. */
 	int padding_threshold   = 512; /* Threshold for padding surfaces. */
 	uint32_t alignedw = 0;
 	uint32_t alignedh = 0;
+#else
+	int vstride;
 #endif
 
 	uint32_t _size = 0;
 
-	switch (android_format) {
-	case HAL_PIXEL_FORMAT_RGBA_8888:
-	case HAL_PIXEL_FORMAT_RGBX_8888:
-	case HAL_PIXEL_FORMAT_BGRA_8888:
-		bpp = 4;
-		break;
-	case HAL_PIXEL_FORMAT_RGB_888:
-		bpp = 3;
-		break;
-	case HAL_PIXEL_FORMAT_RGB_565:
-	case HAL_PIXEL_FORMAT_RGBA_4444:
-		bpp = 2;
-		break;
-	default:
+	desc = _get_format_desc_from_android(android_format);
+	if (!desc)
 		return 0;
-	}
 
-#ifdef QCOM_BSP
-	alignedw = ALIGN(width, 32);
-	alignedh = ALIGN(height, 32);
-	libadreno_utils = dlopen("libadreno_utils.so", RTLD_NOW);
-	if (libadreno_utils) {
-		*(void **)&link_adreno_compute_padding = dlsym(libadreno_utils,
-										   "compute_surface_padding");
-	}
-	if ((libadreno_utils) && (link_adreno_compute_padding)) {
-		// the function below expects the width to be a multiple of
-		// 32 pixels, hence we pass stride instead of width.
-		alignedw = link_adreno_compute_padding(alignedw, bpp,
-											   surface_tile_height, raster_mode,
-											   padding_threshold);
-	}
-	_size = alignedw * alignedh * bpp;
+	if (desc->num_planes > 1)
+		return _tbm_android_surface_calc_yuv_data(width, height, desc, stride,
+												  layout);
 
-	if (size) {
-		*size = _size;
-	}
+	bpp = desc->bpp;
 
-	if (pitch) {
-		*pitch = alignedw * bpp;
+	if (stride) {
+		/* the real stride is known, only the rows we can access are counted */
+		bpr = stride * bpp;
+		_size = bpr * height;
+	} else {
+		/* estimation heavily inspired by the gralloc */
+#ifdef QCOM_BSP
+		alignedw = ALIGN(width, 32);
+		alignedh = ALIGN(height, 32);
+		if (link_adreno_compute_padding) {
+			// the function below expects the width to be a multiple of
+			// 32 pixels, hence we pass stride instead of width.
+			alignedw = link_adreno_compute_padding(alignedw, bpp,
+												   surface_tile_height, raster_mode,
+												   padding_threshold);
+		}
+		bpr = alignedw * bpp;
+		_size = bpr * alignedh;
+#else
+		/* bpr is bytes per row */
+		bpr = ALIGN(width*bpp, 64);
+		vstride = ALIGN(height, 16);
+		if (vstride < height + 2)
+			_size = bpr * (height + 2);
+		else
+			_size = bpr * vstride;
+		_size = ALIGN(_size, PAGE_SIZE);
+#endif
 	}
 
-	DBG("width:%d, height:%d,\n		android_format:%d,"
-		"size:%d, pitch:%d", width, height, android_format, _size, alignedw * bpp);
+	memset(layout, 0x0, sizeof(struct _tbm_android_layout));
+	layout->size = _size;
+	layout->num_planes = 1;
+	layout->pitch[0] = bpr;
+	layout->plane_size[0] = _size;
+
+	DBG("width:%d, height:%d, android_format:%d, stride:%d,\n		"
+		"size:%u, pitch:%u", width, height, android_format, stride, _size, bpr);
 
 	return 1;
-#endif
+}
 
-	/* bpr is bytes per row */
-	bpr = ALIGN(width*bpp, 64);
-	vstride = ALIGN(height, 16);
-	if (vstride < height + 2)
-		_size = bpr * (height + 2);
-	else
-		_size = bpr * vstride;
-	_size = ALIGN(_size, PAGE_SIZE);
+static unsigned int
+_layout_cache_idx(int width, int height, int android_format)
+{
+	return ((unsigned int)width * 31 + (unsigned int)height * 17 +
+			(unsigned int)android_format) & (ANDROID_LAYOUT_CACHE_SIZE - 1);
+}
 
-	if (size) {
-		*size = _size;
+/**
+ * @brief get the data of the surface.
+ * @note It's the cached version of _tbm_android_surface_calc_data, it
+ * returns the layout gralloc has reported for the last allocated surface of
+ * the same size and format or the estimated layout.
+ * @param[in] width : the width of the surface
+ * @param[in] height : the height of the surface
+ * @param[in] android_format : the android_format of the surface
+ * @param[out] layout : the layout of the surface
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+static int
+_tbm_android_surface_get_data(int width, int height, int android_format,
+							  struct _tbm_android_layout *layout)
+{
+	struct _tbm_android_layout_cache_entry *entry;
+	struct _tbm_android_layout _layout;
+
+	entry = &layout_cache.entries[_layout_cache_idx(width, height, android_format)];
+
+	pthread_mutex_lock(&layout_cache.lock);
+
+	if (entry->valid && entry->width == width && entry->height == height &&
+		entry->android_format == android_format) {
+		*layout = entry->layout;
+		layout_cache.hits++;
+
+		pthread_mutex_unlock(&layout_cache.lock);
+		return 1;
 	}
 
-	if (pitch) {
-		*pitch = bpr;
+	layout_cache.misses++;
+
+	pthread_mutex_unlock(&layout_cache.lock);
+
+	if (!_tbm_android_surface_calc_data(width, height, android_format, 0,
+										&_layout))
+		return 0;
+
+	pthread_mutex_lock(&layout_cache.lock);
+
+	/* don't override the layout reported by gralloc meanwhile */
+	if (!entry->valid || entry->width != width || entry->height != height ||
+		entry->android_format != android_format) {
+		entry->valid = 1;
+		entry->width = width;
+		entry->height = height;
+		entry->android_format = android_format;
+		entry->layout = _layout;
 	}
 
-	DBG("width:%d, height:%d, android_format:%d,\n		"
-		"size:%d, pitch:%d", width, height, android_format, _size, bpr);
+	pthread_mutex_unlock(&layout_cache.lock);
+
+	*layout = _layout;
 
 	return 1;
 }
 
-static tbm_bo_handle
-_android_bo_handle(tbm_bufmgr_android bufmgr_android, tbm_bo_android bo_android,
-				   int device)
+/**
+ * @brief remember the real layout of the surface.
+ * @param[in] width : the width of the surface
+ * @param[in] height : the height of the surface
+ * @param[in] android_format : the android_format of the surface
+ * @param[in] layout : the layout computed from the stride gralloc returned
+ */
+static void
+_tbm_android_surface_set_data(int width, int height, int android_format,
+							  const struct _tbm_android_layout *layout)
 {
-	int ret, usage;
-	tbm_bo_handle bo_handle;
-	const gralloc_module_t *gralloc_module;
+	struct _tbm_android_layout_cache_entry *entry;
 
-	gralloc_module = bufmgr_android->gralloc_module;
-	ANDROID_RETURN_VAL_IF_FAIL(gralloc_module != NULL, (tbm_bo_handle) NULL);
+	entry = &layout_cache.entries[_layout_cache_idx(width, height, android_format)];
 
-	memset(&bo_handle, 0x0, sizeof(tbm_bo_handle));
+	pthread_mutex_lock(&layout_cache.lock);
 
-	switch (device) {
-	case TBM_DEVICE_DEFAULT:
-	case TBM_DEVICE_2D:
-		bo_handle.u64 = (uintptr_t)bo_android->handler;
+	entry->valid = 1;
+	entry->width = width;
+	entry->height = height;
+	entry->android_format = android_format;
+	entry->layout = *layout;
 
-		DBG("device:%s, bo_handle.u64:%p", STR_DEVICE[device], bo_android->handler);
+	pthread_mutex_unlock(&layout_cache.lock);
+}
 
-		break;
-	case TBM_DEVICE_CPU:
-		if (!bo_android->pBase) {
-			void *map = NULL;
+/* the time after which the unsignalled fence is reported */
+#define ANDROID_FENCE_WARN_TIMEOUT_MS 3000
+
+/**
+ * @brief wait for the sync fence to be signalled and close it.
+ * @return 1 if the fence has been signalled, otherwise 0.
+ */
+static int
+_android_fence_wait(int fence_fd)
+{
+	struct pollfd fds;
+	int timeout = ANDROID_FENCE_WARN_TIMEOUT_MS;
+	int ret;
 
-			usage = GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_SW_READ_OFTEN;
+	if (fence_fd < 0)
+		return 1;
 
-			ret = gralloc_module->lock(gralloc_module, bo_android->handler,
-					usage, 0, 0, bo_android->width,
-					bo_android->height, &map);
-			if (ret || !map) {
-				TBM_LOG_E("Cannot lock buffer");
-				return (tbm_bo_handle) NULL;
-			}
+	fds.fd = fence_fd;
+	fds.events = POLLIN;
 
-			bo_android->pBase = map;
+	do {
+		ret = poll(&fds, 1, timeout);
+		if (ret == 0 && timeout > 0) {
+			TBM_LOG_W("fence:%d isn't signalled within %d ms, keep waiting",
+					  fence_fd, ANDROID_FENCE_WARN_TIMEOUT_MS);
+			timeout = -1;
 		}
-		bo_handle.ptr = bo_android->pBase;
+	} while (ret == 0 || (ret < 0 && (errno == EINTR || errno == EAGAIN)));
 
-		DBG("device:%s, bo_handle.ptr:%p", STR_DEVICE[device], bo_handle.ptr);
+	close(fence_fd);
 
-		break;
+	if (ret < 0 || (fds.revents & (POLLERR | POLLNVAL))) {
+		TBM_LOG_E("Cannot wait for the fence:%d", fence_fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+_android_gralloc_has_async(const gralloc_module_t *gralloc_module)
+{
+	return gralloc_module->common.module_api_version >= GRALLOC_MODULE_API_VERSION_0_2 &&
+		   gralloc_module->lockAsync && gralloc_module->unlockAsync;
+}
+
+/**
+ * @brief get the gralloc module.
+ * @note TBM_BACKEND_GRALLOC=<path> loads the module from the given library
+ * instead of the system one, e.g. a stand-in gralloc on a host without
+ * the android hardware, the library has to export HAL_MODULE_INFO_SYM.
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+static int
+_android_gralloc_get_module(tbm_bufmgr_android bufmgr_android)
+{
+	const hw_module_t *module;
+	char *path;
+
+	path = getenv("TBM_BACKEND_GRALLOC");
+	if (!path)
+		return !hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
+							  (const hw_module_t **)&bufmgr_android->gralloc_module) &&
+			   bufmgr_android->gralloc_module;
+
+	bufmgr_android->gralloc_dso = dlopen(path, RTLD_NOW);
+	if (!bufmgr_android->gralloc_dso) {
+		TBM_LOG_E("Cannot load %s: %s", path, dlerror());
+		return 0;
+	}
+
+	module = dlsym(bufmgr_android->gralloc_dso, HAL_MODULE_INFO_SYM_AS_STR);
+	if (!module || !module->id || strcmp(module->id, GRALLOC_HARDWARE_MODULE_ID)) {
+		TBM_LOG_E("%s isn't a gralloc module", path);
+		dlclose(bufmgr_android->gralloc_dso);
+		bufmgr_android->gralloc_dso = NULL;
+		return 0;
+	}
+
+	TBM_LOG_I("use the gralloc module %s (%s)", path, module->name);
+
+	bufmgr_android->gralloc_module = (const gralloc_module_t *)module;
+
+	return 1;
+}
+
+static void
+_android_gralloc_put_module(tbm_bufmgr_android bufmgr_android)
+{
+	if (bufmgr_android->gralloc_dso)
+		dlclose(bufmgr_android->gralloc_dso);
+}
+
+/**
+ * @brief load the gralloc module and open the alloc device at the first use.
+ * @note Processes which only query formats or never allocate don't pay for
+ * loading the vendor gralloc. The result (including a failure) is cached,
+ * the fast path is one acquire load.
+ * @return 1 if the gralloc is ready, otherwise 0.
+ */
+static int
+_android_gralloc_open(tbm_bufmgr_android bufmgr_android)
+{
+	int state;
+
+	state = __atomic_load_n(&bufmgr_android->gralloc_state, __ATOMIC_ACQUIRE);
+	if (state)
+		return state > 0;
+
+	pthread_mutex_lock(&bufmgr_android->gralloc_lock);
+
+	state = bufmgr_android->gralloc_state;
+	if (state)
+		goto done;
+
+	state = -1;
+
+	if (!_android_gralloc_get_module(bufmgr_android)) {
+		TBM_LOG_E("Cannot get gralloc hardware module!");
+		goto done;
+	}
+
+	if (gralloc_open((const hw_module_t *)bufmgr_android->gralloc_module,
+					 &bufmgr_android->alloc_dev) || !bufmgr_android->alloc_dev) {
+		TBM_LOG_E("Cannot open the gralloc!");
+		bufmgr_android->alloc_dev = NULL;
+		_android_gralloc_put_module(bufmgr_android);
+		goto done;
+	}
+
+	TBM_LOG_I("gralloc version: %x.\n",
+			  bufmgr_android->alloc_dev->common.version & 0xFFFF0000);
+	TBM_LOG_I("gralloc module api version: %hu.\n",
+			  bufmgr_android->alloc_dev->common.module->module_api_version);
+
+	if (__atomic_load_n(&bufmgr_android->async_lock, __ATOMIC_ACQUIRE) &&
+		!_android_gralloc_has_async(bufmgr_android->gralloc_module)) {
+		TBM_LOG_W("gralloc doesn't support the async lock, use the blocking one");
+		__atomic_store_n(&bufmgr_android->async_lock, 0, __ATOMIC_RELEASE);
+	}
+
+	state = 1;
+
+done:
+	__atomic_store_n(&bufmgr_android->gralloc_state, state, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&bufmgr_android->gralloc_lock);
+
+	return state > 0;
+}
+
+static void
+_android_gralloc_close(tbm_bufmgr_android bufmgr_android)
+{
+	if (bufmgr_android->gralloc_state > 0) {
+		gralloc_close(bufmgr_android->alloc_dev);
+		_android_gralloc_put_module(bufmgr_android);
+	}
+
+	pthread_mutex_destroy(&bufmgr_android->gralloc_lock);
+}
+
+static unsigned long long
+_get_env_ull(const char *name, unsigned long long def)
+{
+	char *env;
+
+	env = getenv(name);
+	if (!env)
+		return def;
+
+	return strtoull(env, NULL, 0);
+}
+
+static uint64_t
+_stats_now(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+/* @brief count the call of TBM_ANDROID_STATS_* started at @c start, ns */
+static void
+_stats_latency(tbm_bufmgr_android bufmgr_android, int latency, uint64_t start)
+{
+	uint64_t us = (_stats_now() - start) / 1000;
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket >= TBM_ANDROID_STATS_HIST_BUCKETS)
+		bucket = TBM_ANDROID_STATS_HIST_BUCKETS - 1;
+
+	__atomic_add_fetch(&bufmgr_android->stats.latency[latency][bucket], 1,
+					   __ATOMIC_RELAXED);
+}
+
+static void
+_stats_count(uint64_t *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* @brief account the bo which has come (@c sign 1) or gone (@c sign -1) */
+static void
+_stats_bo_live(tbm_bo_android bo_android, int sign)
+{
+	struct _tbm_android_stats_counters *stats = &bo_android->bufmgr_android->stats;
+	const struct _tbm_android_format_desc *desc;
+	uint64_t bytes = (uint64_t)((int64_t)sign * bo_android->layout.size);
+	unsigned int row = ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT;
+
+	desc = _get_format_desc_from_tbm(bo_android->format_tbm);
+	if (desc)
+		row = desc - android_tizen_formats;
+
+	/* the unsigned counters wrap, so adding the negated value subtracts */
+	__atomic_add_fetch(&stats->live_bos, (uint64_t)(int64_t)sign,
+					   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->live_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->format_bytes[row], bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->flags_bytes[bo_android->flags_tbm &
+										   ANDROID_TBM_FLAGS_MASK],
+					   bytes, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+_stats_load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void
+_stats_dump(tbm_bufmgr_android bufmgr_android)
+{
+	static const char *names[TBM_ANDROID_STATS_LATENCIES] = {
+		"alloc", "lock", "unlock"
+	};
+	struct _tbm_android_stats_counters *stats = &bufmgr_android->stats;
+	char buf[512];
+	uint64_t val;
+	uint32_t format;
+	unsigned int i, j;
+	int len;
+
+	TBM_LOG_I("stats: live bos:%llu bytes:%llu, allocs:%llu, frees:%llu, imports:%llu, maps:%llu, unmaps:%llu",
+			  (unsigned long long)_stats_load(&stats->live_bos),
+			  (unsigned long long)_stats_load(&stats->live_bytes),
+			  (unsigned long long)_stats_load(&stats->allocs),
+			  (unsigned long long)_stats_load(&stats->frees),
+			  (unsigned long long)_stats_load(&stats->imports),
+			  (unsigned long long)_stats_load(&stats->maps),
+			  (unsigned long long)_stats_load(&stats->unmaps));
+
+	for (i = 0; i <= ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT; i++) {
+		val = _stats_load(&stats->format_bytes[i]);
+		if (!val)
+			continue;
+
+		if (i == ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT) {
+			TBM_LOG_I("stats: live format:unknown bytes:%llu",
+					  (unsigned long long)val);
+			continue;
+		}
+
+		format = android_tizen_formats[i].tbm_format;
+		TBM_LOG_I("stats: live format:%c%c%c%c bytes:%llu",
+				  format & 0xff, (format >> 8) & 0xff, (format >> 16) & 0xff,
+				  (format >> 24) & 0xff, (unsigned long long)val);
+	}
+
+	for (i = 0; i <= ANDROID_TBM_FLAGS_MASK; i++) {
+		val = _stats_load(&stats->flags_bytes[i]);
+		if (val)
+			TBM_LOG_I("stats: live flags:%u bytes:%llu", i,
+					  (unsigned long long)val);
+	}
+
+	for (i = 0; i < TBM_ANDROID_STATS_LATENCIES; i++) {
+		len = 0;
+		buf[0] = '\0';
+
+		for (j = 0; j < TBM_ANDROID_STATS_HIST_BUCKETS; j++) {
+			val = _stats_load(&stats->latency[i][j]);
+			if (!val || len >= (int)sizeof(buf))
+				continue;
+
+			if (j == TBM_ANDROID_STATS_HIST_BUCKETS - 1)
+				len += snprintf(buf + len, sizeof(buf) - len, " >=%lluus:%llu",
+								1ULL << (j - 1), (unsigned long long)val);
+			else
+				len += snprintf(buf + len, sizeof(buf) - len, " <%lluus:%llu",
+								1ULL << j, (unsigned long long)val);
+		}
+
+		if (buf[0])
+			TBM_LOG_I("stats: %s latency:%s", names[i], buf);
+	}
+}
+
+/* the semaphore posted by the signal handler, only one bufmgr dumps */
+static sem_t *stats_signal_sem;
+
+static void
+_stats_signal_handler(int signo)
+{
+	/* the logging isn't async-signal-safe, sem_post is */
+	sem_post(stats_signal_sem);
+}
+
+static void *
+_stats_worker(void *data)
+{
+	tbm_bufmgr_android bufmgr_android = data;
+	struct _tbm_android_stats_counters *stats = &bufmgr_android->stats;
+
+	while (1) {
+		if (sem_wait(&stats->sem)) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (__atomic_load_n(&stats->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		_stats_dump(bufmgr_android);
+	}
+
+	return NULL;
+}
+
+static void
+_stats_init(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_stats_counters *stats = &bufmgr_android->stats;
+	struct sigaction action;
+	int signo;
+
+	signo = (int)_get_env_ull("TBM_BACKEND_STATS_SIGNAL", 0);
+	if (!signo)
+		return;
+
+	if (signo < 0 || signo >= NSIG || signo == SIGKILL || signo == SIGSTOP) {
+		TBM_LOG_W("Invalid TBM_BACKEND_STATS_SIGNAL:%d", signo);
+		return;
+	}
+
+	if (stats_signal_sem) {
+		TBM_LOG_W("The stats signal is taken by another bufmgr");
+		return;
+	}
+
+	if (sem_init(&stats->sem, 0, 0)) {
+		TBM_LOG_E("Cannot init the stats semaphore: %m");
+		return;
+	}
+
+	if (pthread_create(&stats->thread, NULL, _stats_worker, bufmgr_android)) {
+		TBM_LOG_E("Cannot create the stats thread");
+		sem_destroy(&stats->sem);
+		return;
+	}
+
+	stats_signal_sem = &stats->sem;
+
+	memset(&action, 0x0, sizeof(action));
+	action.sa_handler = _stats_signal_handler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+
+	if (sigaction(signo, &action, &stats->old_action)) {
+		TBM_LOG_E("Cannot handle the stats signal:%d: %m", signo);
+		__atomic_store_n(&stats->stop, 1, __ATOMIC_RELEASE);
+		sem_post(&stats->sem);
+		pthread_join(stats->thread, NULL);
+		sem_destroy(&stats->sem);
+		stats_signal_sem = NULL;
+		return;
+	}
+
+	stats->signo = signo;
+
+	TBM_LOG_I("stats are dumped on the signal:%d", signo);
+}
+
+static void
+_stats_deinit(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_stats_counters *stats = &bufmgr_android->stats;
+
+	if (stats->signo) {
+		sigaction(stats->signo, &stats->old_action, NULL);
+
+		__atomic_store_n(&stats->stop, 1, __ATOMIC_RELEASE);
+		sem_post(&stats->sem);
+		pthread_join(stats->thread, NULL);
+		sem_destroy(&stats->sem);
+		stats_signal_sem = NULL;
+		stats->signo = 0;
+	}
+
+	_stats_dump(bufmgr_android);
+}
+
+/* @brief get ANDROID_HEAP_KIND_* of the native handle made by the heap engine or 0 */
+static int
+_heap_handle_kind(const native_handle_t *native_handle)
+{
+	if (native_handle->numFds != 1 ||
+		native_handle->numInts != ANDROID_HEAP_NUM_INTS ||
+		native_handle->data[1] != ANDROID_HEAP_MAGIC)
+		return 0;
+
+	return native_handle->data[2];
+}
+
+static uint64_t
+_heap_sync_flags(int usage)
+{
+	uint64_t flags = 0;
+
+	if (usage & GRALLOC_USAGE_SW_READ_MASK)
+		flags |= ANDROID_DMA_BUF_SYNC_READ;
+	if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+		flags |= ANDROID_DMA_BUF_SYNC_WRITE;
+
+	return flags;
+}
+
+/**
+ * @brief begin the cpu access of the heap engine buffer.
+ * @note The buffer is mapped once and stays mapped until the bo is freed,
+ * the dma-buf is synced for the access, the memfd needs nothing.
+ * @return the address of the buffer or NULL in an error case.
+ */
+static void *
+_heap_lock(tbm_bo_android bo_android, int usage)
+{
+	struct _android_dma_buf_sync sync;
+	int fd = bo_android->handler->data[0];
+	int fence_fd;
+	void *map;
+
+	fence_fd = bo_android->acquire_fence;
+	bo_android->acquire_fence = -1;
+
+	if (!_android_fence_wait(fence_fd))
+		return NULL;
+
+	if (!bo_android->heap_map) {
+		map = mmap(NULL, bo_android->handler->data[3], PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			TBM_LOG_E("bo:%p, cannot map the heap buffer: %m", bo_android);
+			return NULL;
+		}
+
+		bo_android->heap_map = map;
+	}
+
+	if (bo_android->heap == ANDROID_HEAP_KIND_DMABUF) {
+		sync.flags = ANDROID_DMA_BUF_SYNC_START | _heap_sync_flags(usage);
+		if (ioctl(fd, ANDROID_DMA_BUF_IOCTL_SYNC, &sync))
+			TBM_LOG_W("bo:%p, cannot sync the dma-buf: %m", bo_android);
+	}
+
+	return bo_android->heap_map;
+}
+
+static void
+_heap_unlock(tbm_bo_android bo_android)
+{
+	struct _android_dma_buf_sync sync;
+
+	if (bo_android->heap != ANDROID_HEAP_KIND_DMABUF)
+		return;
+
+	sync.flags = ANDROID_DMA_BUF_SYNC_END |
+				 _heap_sync_flags(bo_android->lock_usage);
+	if (ioctl(bo_android->handler->data[0], ANDROID_DMA_BUF_IOCTL_SYNC, &sync))
+		TBM_LOG_W("bo:%p, cannot sync the dma-buf: %m", bo_android);
+}
+
+/**
+ * @brief lock the yuv buffer by lock_ycbcr and refine its layout.
+ * @note The @c fence_fd stays owned by the caller.
+ * @return the address of the buffer or NULL if the gralloc can't lock it so.
+ */
+static void *
+_android_bo_lock_ycbcr(const gralloc_module_t *gralloc_module,
+					   tbm_bo_android bo_android, int usage,
+					   const struct _tbm_android_rect *rect, int fence_fd)
+{
+	struct android_ycbcr ycbcr;
+	struct _tbm_android_layout *layout = &bo_android->layout;
+	uintptr_t y, cb, cr;
+	int ret;
+
+	if (gralloc_module->common.module_api_version < GRALLOC_MODULE_API_VERSION_0_1 ||
+		!gralloc_module->lock_ycbcr)
+		return NULL;
+
+	memset(&ycbcr, 0x0, sizeof(ycbcr));
+
+	if (__atomic_load_n(&bo_android->bufmgr_android->async_lock,
+						__ATOMIC_ACQUIRE) &&
+		gralloc_module->common.module_api_version >= GRALLOC_MODULE_API_VERSION_0_3 &&
+		gralloc_module->lockAsync_ycbcr) {
+		/* the gralloc takes the ownership of the fence */
+		ret = gralloc_module->lockAsync_ycbcr(gralloc_module, bo_android->handler,
+				usage, rect->x, rect->y, rect->width, rect->height, &ycbcr,
+				fence_fd >= 0 ? dup(fence_fd) : -1);
+	} else {
+		if (fence_fd >= 0 && !_android_fence_wait(dup(fence_fd)))
+			return NULL;
+
+		ret = gralloc_module->lock_ycbcr(gralloc_module, bo_android->handler,
+				usage, rect->x, rect->y, rect->width, rect->height, &ycbcr);
+	}
+	if (ret || !ycbcr.y) {
+		TBM_LOG_W("Cannot lock buffer by lock_ycbcr, fallback to lock");
+		return NULL;
+	}
+
+	y = (uintptr_t)ycbcr.y;
+	cb = (uintptr_t)ycbcr.cb;
+	cr = (uintptr_t)ycbcr.cr;
+
+	/* the planes must follow the Y plane to be described by the offsets */
+	if (cb < y || cr < y) {
+		DBG("bo:%p, the planes precede the Y plane, keep the layout", bo_android);
+		return ycbcr.y;
+	}
+
+	layout->pitch[0] = ycbcr.ystride;
+
+	if (layout->num_planes == 3) {
+		/* YV12, Cr plane goes first */
+		layout->offset[1] = cr - y;
+		layout->pitch[1] = ycbcr.cstride;
+		layout->offset[2] = cb - y;
+		layout->pitch[2] = ycbcr.cstride;
+	} else if (layout->num_planes == 2) {
+		/* semi-planar, the chroma plane starts with the lower address */
+		layout->offset[1] = (cb < cr ? cb : cr) - y;
+		layout->pitch[1] = ycbcr.cstride;
+	}
+
+	DBG("bo:%p, y:%p, cb:%p, cr:%p, ystride:%zu, cstride:%zu, chroma_step:%zu",
+		bo_android, ycbcr.y, ycbcr.cb, ycbcr.cr, ycbcr.ystride, ycbcr.cstride,
+		ycbcr.chroma_step);
+
+	return ycbcr.y;
+}
+
+/* @brief get the gralloc usage to lock the buffer with for the access @c opt */
+static int
+_get_lock_usage_from_opt(int opt)
+{
+	int usage = 0;
+
+	if (opt & TBM_OPTION_READ)
+		usage |= GRALLOC_USAGE_SW_READ_OFTEN;
+	if (opt & TBM_OPTION_WRITE)
+		usage |= GRALLOC_USAGE_SW_WRITE_OFTEN;
+
+	/* the access isn't specified, so the caller may do anything */
+	if (!usage)
+		usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+
+	return usage;
+}
+
+/**
+ * @brief lock the region @c rect of the buffer for the cpu access.
+ * @note Must be called with the bo lock held. The acquire fence of the bo is
+ * consumed, in the async mode the gralloc waits for it, otherwise it's waited
+ * here right before the lock.
+ * @return the address of the buffer (not of the region) or NULL in an error case.
+ */
+static void *
+_android_bo_lock(const gralloc_module_t *gralloc_module,
+				 tbm_bo_android bo_android, int usage,
+				 const struct _tbm_android_rect *rect)
+{
+	void *map = NULL;
+	uint64_t start;
+	int ret, fence_fd;
+
+	if (bo_android->heap)
+		return _heap_lock(bo_android, usage);
+
+	start = _stats_now();
+	fence_fd = bo_android->acquire_fence;
+	bo_android->acquire_fence = -1;
+
+	if (_is_yuv_format(bo_android->format_android)) {
+		map = _android_bo_lock_ycbcr(gralloc_module, bo_android, usage, rect,
+									 fence_fd);
+		if (map) {
+			if (fence_fd >= 0)
+				close(fence_fd);
+			_stats_latency(bo_android->bufmgr_android, TBM_ANDROID_STATS_LOCK,
+						   start);
+			return map;
+		}
+	}
+
+	if (__atomic_load_n(&bo_android->bufmgr_android->async_lock,
+						__ATOMIC_ACQUIRE)) {
+		/* the gralloc takes the ownership of the fence */
+		ret = gralloc_module->lockAsync(gralloc_module, bo_android->handler,
+				usage, rect->x, rect->y, rect->width, rect->height, &map,
+				fence_fd);
+	} else {
+		if (!_android_fence_wait(fence_fd))
+			return NULL;
+
+		ret = gralloc_module->lock(gralloc_module, bo_android->handler,
+				usage, rect->x, rect->y, rect->width, rect->height, &map);
+	}
+	if (ret || !map) {
+		TBM_LOG_E("Cannot lock buffer");
+		return NULL;
+	}
+
+	_stats_latency(bo_android->bufmgr_android, TBM_ANDROID_STATS_LOCK, start);
+
+	return map;
+}
+
+static void
+_swizzle_rb565_row(uint16_t *dst, const uint16_t *src, int width)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON)
+	const uint16x8_t g_mask = vdupq_n_u16(0x07e0);
+	uint16x8_t p;
+
+	for (; i + 8 <= width; i += 8) {
+		p = vld1q_u16(src + i);
+		p = vorrq_u16(vorrq_u16(vshrq_n_u16(p, 11), vshlq_n_u16(p, 11)),
+					  vandq_u16(p, g_mask));
+		vst1q_u16(dst + i, p);
+	}
+#elif defined(__SSE2__)
+	const __m128i g_mask = _mm_set1_epi16(0x07e0);
+	__m128i p;
+
+	for (; i + 8 <= width; i += 8) {
+		p = _mm_loadu_si128((const __m128i *)(src + i));
+		p = _mm_or_si128(_mm_or_si128(_mm_srli_epi16(p, 11),
+									  _mm_slli_epi16(p, 11)),
+						 _mm_and_si128(p, g_mask));
+		_mm_storeu_si128((__m128i *)(dst + i), p);
+	}
+#endif
+
+	for (; i < width; i++)
+		dst[i] = (src[i] >> 11) | (src[i] << 11) | (src[i] & 0x07e0);
+}
+
+static void
+_swizzle_opaque_row(uint32_t *dst, const uint32_t *src, int width)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON)
+	const uint32x4_t alpha = vdupq_n_u32(0xff000000);
+
+	for (; i + 4 <= width; i += 4)
+		vst1q_u32(dst + i, vorrq_u32(vld1q_u32(src + i), alpha));
+#elif defined(__SSE2__)
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+	for (; i + 4 <= width; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + i),
+						 _mm_or_si128(_mm_loadu_si128((const __m128i *)(src + i)),
+									  alpha));
+#endif
+
+	for (; i < width; i++)
+		dst[i] = src[i] | 0xff000000;
+}
+
+/**
+ * @brief convert the pixels between the gralloc buffer and its shadow.
+ * @note The shadow has the layout of the buffer, only the @c width pixels
+ * of every row are converted, the padding is left alone.
+ * @param to_gralloc 1 to store the shadow, 0 to fill it
+ */
+static void
+_android_bo_swizzle(tbm_bo_android bo_android, void *dst, const void *src,
+					int to_gralloc)
+{
+	uint32_t pitch = bo_android->layout.pitch[0];
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	int y;
+
+	for (y = 0; y < bo_android->height; y++, d += pitch, s += pitch) {
+		switch (bo_android->swizzle) {
+		case ANDROID_SWIZZLE_RB565:
+			_swizzle_rb565_row((uint16_t *)d, (const uint16_t *)s,
+							   bo_android->width);
+			break;
+		case ANDROID_SWIZZLE_OPAQUE:
+			/* the alpha read from the buffer is the unused byte as is */
+			if (to_gralloc)
+				_swizzle_opaque_row((uint32_t *)d, (const uint32_t *)s,
+									bo_android->width);
+			else
+				memcpy(d, s, bo_android->width * 4);
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+/**
+ * @brief unlock the buffer locked for the cpu access.
+ * @note Must be called with the bo lock held. In the async mode the gralloc
+ * doesn't wait for the cache maintenance, the bo gets the release fence
+ * instead.
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+static int
+_android_bo_unlock(const gralloc_module_t *gralloc_module,
+				   tbm_bo_android bo_android)
+{
+	uint64_t start;
+	int fence_fd = -1;
+
+	/* the cpu writes reach the buffer before it's unlocked */
+	if (bo_android->shadow_dirty && bo_android->pBase) {
+		_android_bo_swizzle(bo_android, bo_android->pBase, bo_android->shadow, 1);
+		bo_android->shadow_dirty = 0;
+	}
+	bo_android->shadow_valid = 0;
+
+	if (bo_android->heap) {
+		_heap_unlock(bo_android);
+		return 1;
+	}
+
+	start = _stats_now();
+
+	if (!__atomic_load_n(&bo_android->bufmgr_android->async_lock,
+						__ATOMIC_ACQUIRE)) {
+		if (gralloc_module->unlock(gralloc_module, bo_android->handler)) {
+			TBM_LOG_E("Cannot unlock buffer");
+			return 0;
+		}
+
+		_stats_latency(bo_android->bufmgr_android, TBM_ANDROID_STATS_UNLOCK,
+					   start);
+
+		return 1;
+	}
+
+	if (gralloc_module->unlockAsync(gralloc_module, bo_android->handler,
+									&fence_fd)) {
+		TBM_LOG_E("Cannot unlock buffer");
+		return 0;
+	}
+
+	_stats_latency(bo_android->bufmgr_android, TBM_ANDROID_STATS_UNLOCK, start);
+
+	/* the buffer is unlocked in order, the newer fence covers the older one */
+	if (bo_android->release_fence >= 0)
+		close(bo_android->release_fence);
+	bo_android->release_fence = fence_fd;
+
+	DBG("bo:%p, release_fence:%d", bo_android, fence_fd);
+
+	return 1;
+}
+
+/**
+ * @brief relock the locked buffer with the wider usage or region.
+ * @note Must be called with the bo lock held, by the only mapper of the bo.
+ * @return the address of the buffer or NULL in an error case.
+ */
+static void *
+_android_bo_relock(const gralloc_module_t *gralloc_module,
+				   tbm_bo_android bo_android, int usage,
+				   const struct _tbm_android_rect *rect)
+{
+	void *map;
+
+	if (!_android_bo_unlock(gralloc_module, bo_android))
+		return NULL;
+
+	/* the new lock has to wait for the cache maintenance of the old one */
+	bo_android->acquire_fence = bo_android->release_fence;
+	bo_android->release_fence = -1;
+
+	map = _android_bo_lock(gralloc_module, bo_android, usage, rect);
+	if (!map) {
+		/* the old mappers keep using the buffer, so it must stay locked */
+		map = _android_bo_lock(gralloc_module, bo_android, bo_android->lock_usage,
+							   &bo_android->lock_rect);
+		if (map && map != bo_android->pBase)
+			TBM_LOG_E("bo:%p, the buffer has moved from %p to %p on relock",
+					  bo_android, bo_android->pBase, map);
+		return NULL;
+	}
+
+	/* nobody else has the old address, so the move is harmless */
+	if (map != bo_android->pBase)
+		DBG("bo:%p, the buffer has moved from %p to %p on relock",
+			bo_android, bo_android->pBase, map);
+
+	DBG("bo:%p, usage:0x%x -> 0x%x, rect:%d,%d %dx%d -> %d,%d %dx%d", bo_android,
+		bo_android->lock_usage, usage, bo_android->lock_rect.x,
+		bo_android->lock_rect.y, bo_android->lock_rect.width,
+		bo_android->lock_rect.height, rect->x, rect->y, rect->width, rect->height);
+
+	return map;
+}
+
+static int
+_rect_contains(const struct _tbm_android_rect *outer,
+			   const struct _tbm_android_rect *inner)
+{
+	return inner->x >= outer->x && inner->y >= outer->y &&
+		   inner->x + inner->width <= outer->x + outer->width &&
+		   inner->y + inner->height <= outer->y + outer->height;
+}
+
+/* @brief extend the rectangle @c rect to contain the rectangle @c other */
+static void
+_rect_merge(struct _tbm_android_rect *rect, const struct _tbm_android_rect *other)
+{
+	int x2, y2;
+
+	x2 = rect->x + rect->width;
+	if (other->x + other->width > x2)
+		x2 = other->x + other->width;
+	y2 = rect->y + rect->height;
+	if (other->y + other->height > y2)
+		y2 = other->y + other->height;
+
+	if (other->x < rect->x)
+		rect->x = other->x;
+	if (other->y < rect->y)
+		rect->y = other->y;
+
+	rect->width = x2 - rect->x;
+	rect->height = y2 - rect->y;
+}
+
+/**
+ * @brief lock the region @c rect of the buffer for the cpu access with
+ * the @c usage.
+ * @note If the buffer is already locked, but the lock doesn't cover the
+ * requested usage or region, it's relocked with the merged ones. That's
+ * refused while the bo has other mappers, the caller holds one reference.
+ * @return the address of the buffer or NULL in an error case.
+ */
+static void *
+_android_bo_cpu_lock(const gralloc_module_t *gralloc_module,
+					 tbm_bo_android bo_android, int usage,
+					 const struct _tbm_android_rect *rect)
+{
+	struct _tbm_android_rect lock_rect;
+	void *map;
+	int full;
+
+	/*
+	 * The whole buffer is already locked for the requested access. lock_full
+	 * is published last, so the address read after it is the one it covers.
+	 */
+	if (__atomic_load_n(&bo_android->lock_full, __ATOMIC_SEQ_CST)) {
+		map = __atomic_load_n(&bo_android->pBase, __ATOMIC_ACQUIRE);
+		if (map &&
+			!(usage & ~__atomic_load_n(&bo_android->lock_usage, __ATOMIC_ACQUIRE)))
+			return map;
+	}
+
+	pthread_mutex_lock(&bo_android->lock);
+
+	if (!bo_android->pBase) {
+		map = _android_bo_lock(gralloc_module, bo_android, usage, rect);
+		if (!map) {
+			pthread_mutex_unlock(&bo_android->lock);
+			return NULL;
+		}
+
+		lock_rect = *rect;
+	} else if ((usage & ~bo_android->lock_usage) ||
+			   !_rect_contains(&bo_android->lock_rect, rect)) {
+		/*
+		 * The buffer is locked with the narrower access or region. The other
+		 * mappers use the address without the lock, so it's upgraded only if
+		 * the caller's reference is the only one. The lock-free path is closed
+		 * first: a concurrent map either sees it closed and waits for the lock
+		 * or has already taken its reference, which is seen here.
+		 */
+		full = bo_android->lock_full;
+		__atomic_store_n(&bo_android->lock_full, 0, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&bo_android->map_cnt, __ATOMIC_SEQ_CST) > 1) {
+			__atomic_store_n(&bo_android->lock_full, full, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&bo_android->lock);
+			TBM_LOG_E("bo:%p is mapped by others with usage:0x%x, the first map must have the widest usage and region",
+					  bo_android, bo_android->lock_usage);
+			return NULL;
+		}
+
+		usage |= bo_android->lock_usage;
+		lock_rect = bo_android->lock_rect;
+		_rect_merge(&lock_rect, rect);
+
+		map = _android_bo_relock(gralloc_module, bo_android, usage, &lock_rect);
+		if (!map) {
+			__atomic_store_n(&bo_android->lock_full, full, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&bo_android->lock);
+			return NULL;
+		}
+	} else {
+		map = bo_android->pBase;
+		pthread_mutex_unlock(&bo_android->lock);
+		return map;
+	}
+
+	full = lock_rect.x == 0 && lock_rect.y == 0 &&
+		   lock_rect.width == bo_android->width &&
+		   lock_rect.height == bo_android->height;
+
+	bo_android->lock_rect = lock_rect;
+
+	/* publish the address, lock_full opens the lock-free path to it */
+	__atomic_store_n(&bo_android->lock_usage, usage, __ATOMIC_RELEASE);
+	__atomic_store_n(&bo_android->pBase, map, __ATOMIC_RELEASE);
+	__atomic_store_n(&bo_android->lock_full, full, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&bo_android->lock);
+
+	return map;
+}
+
+/**
+ * @brief map the buffer for the cpu access @c opt.
+ * @note The wrapped user memory is returned without any lock.
+ * The buffer of the format gralloc can't allocate is locked whole and
+ * the cpu gets its converted shadow. The shadow is filled once per lock and
+ * stored back at the unlock only if it has been mapped for writing.
+ * @return the address of the buffer or its shadow, NULL in an error case.
+ */
+static void *
+_android_bo_cpu_map(const gralloc_module_t *gralloc_module,
+					tbm_bo_android bo_android, int opt,
+					const struct _tbm_android_rect *rect)
+{
+	struct _tbm_android_rect full;
+	void *shadow;
+	int fence_fd;
+
+	/* the user memory is accessed as is, only the fence is waited */
+	if (bo_android->wrap_ptr) {
+		pthread_mutex_lock(&bo_android->lock);
+		fence_fd = bo_android->acquire_fence;
+		bo_android->acquire_fence = -1;
+		pthread_mutex_unlock(&bo_android->lock);
+
+		return _android_fence_wait(fence_fd) ? bo_android->wrap_ptr : NULL;
+	}
+
+	if (!bo_android->swizzle)
+		return _android_bo_cpu_lock(gralloc_module, bo_android,
+									_get_lock_usage_from_opt(opt), rect);
+
+	full.x = 0;
+	full.y = 0;
+	full.width = bo_android->width;
+	full.height = bo_android->height;
+
+	if (!_android_bo_cpu_lock(gralloc_module, bo_android,
+							  _get_lock_usage_from_opt(opt | TBM_OPTION_READ),
+							  &full))
+		return NULL;
+
+	pthread_mutex_lock(&bo_android->lock);
+
+	if (!bo_android->shadow) {
+		bo_android->shadow = malloc(bo_android->layout.size);
+		if (!bo_android->shadow) {
+			pthread_mutex_unlock(&bo_android->lock);
+			TBM_LOG_E("bo:%p, cannot allocate the shadow", bo_android);
+			return NULL;
+		}
+	}
+
+	/* the buffer may have been relocked meanwhile, pBase is the current one */
+	if (!bo_android->shadow_valid) {
+		_android_bo_swizzle(bo_android, bo_android->shadow, bo_android->pBase, 0);
+		bo_android->shadow_valid = 1;
+	}
+
+	if (opt & TBM_OPTION_WRITE)
+		bo_android->shadow_dirty = 1;
+
+	shadow = bo_android->shadow;
+
+	pthread_mutex_unlock(&bo_android->lock);
+
+	return shadow;
+}
+
+/**
+ * @brief unlock the buffer left locked by the persistent mapping, so the cpu
+ * caches are cleaned before a device accesses the buffer and invalidated
+ * when the cpu maps it next time.
+ * @note The buffer mapped by somebody right now stays locked.
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+static int
+_android_bo_flush(const gralloc_module_t *gralloc_module,
+				  tbm_bo_android bo_android)
+{
+	int ret = 1;
+
+	if (!__atomic_load_n(&bo_android->pBase, __ATOMIC_ACQUIRE))
+		return 1;
+
+	/* the first map takes the lock, so the counter can't leave 0 meanwhile */
+	pthread_mutex_lock(&bo_android->lock);
+
+	if (bo_android->pBase &&
+		!__atomic_load_n(&bo_android->map_cnt, __ATOMIC_ACQUIRE)) {
+		if (_android_bo_unlock(gralloc_module, bo_android)) {
+			/* the lock-free path is closed before the address goes */
+			__atomic_store_n(&bo_android->lock_full, 0, __ATOMIC_RELEASE);
+			__atomic_store_n(&bo_android->pBase, NULL, __ATOMIC_RELEASE);
+			DBG("bo:%p is flushed", bo_android);
+		} else {
+			ret = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&bo_android->lock);
+
+	return ret;
+}
+
+/* @brief get the gralloc usage the device accesses the buffer with */
+static int
+_get_usage_from_device(int device)
+{
+	switch (device) {
+	case TBM_DEVICE_2D:
+		return GRALLOC_USAGE_HW_2D | GRALLOC_USAGE_HW_COMPOSER;
 	case TBM_DEVICE_3D:
+		return GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER;
 	case TBM_DEVICE_MM:
+		return GRALLOC_USAGE_HW_VIDEO_ENCODER | GRALLOC_USAGE_HW_CAMERA_MASK;
 	default:
-		TBM_LOG_E("Not supported device:%s\n", STR_DEVICE[device]);
+		return 0;
+	}
+}
+
+static tbm_bo_handle
+_android_bo_handle(tbm_bufmgr_android bufmgr_android, tbm_bo_android bo_android,
+				   int device, int opt)
+{
+	tbm_bo_handle bo_handle;
+	const gralloc_module_t *gralloc_module;
+	struct _tbm_android_rect rect;
+	int usage;
+
+	/* NULL only if the gralloc isn't loaded, then the bo is the heap's */
+	gralloc_module = bufmgr_android->gralloc_module;
+
+	memset(&bo_handle, 0x0, sizeof(tbm_bo_handle));
+
+	switch (device) {
+	case TBM_DEVICE_DEFAULT:
+	case TBM_DEVICE_2D:
+	case TBM_DEVICE_3D:
+		if (bo_android->wrap_ptr) {
+			TBM_LOG_E("bo:%p, the user memory has no device handle", bo_android);
+			break;
+		}
+
+		/* the handle of the heap engine would be misread as the gralloc's */
+		if (bo_android->heap) {
+			TBM_LOG_E("bo:%p, the heap buffer has no device handle", bo_android);
+			break;
+		}
+
+		_android_bo_flush(gralloc_module, bo_android);
+
+		/*
+		 * The gralloc and the gpu driver import the buffer by the native
+		 * handle, e.g. as EGL_NATIVE_BUFFER_ANDROID.
+		 */
+		bo_handle.u64 = (uintptr_t)bo_android->handler;
+
+		DBG("device:%s, bo_handle.u64:%p", STR_DEVICE[device], bo_android->handler);
+
+		break;
+	case TBM_DEVICE_CPU:
+		rect.x = 0;
+		rect.y = 0;
+		rect.width = bo_android->width;
+		rect.height = bo_android->height;
+
+		bo_handle.ptr = _android_bo_cpu_map(gralloc_module, bo_android, opt,
+											&rect);
+
+		DBG("device:%s, bo_handle.ptr:%p", STR_DEVICE[device], bo_handle.ptr);
+
+		break;
+	case TBM_DEVICE_MM:
+		/* the codecs import the dma-buf, the fd stays owned by the bo */
+		if (bo_android->wrap_ptr) {
+			if (bo_android->wrap_map && bo_android->wrap_fd >= 0)
+				bo_handle.u32 = bo_android->wrap_fd;
+			else
+				TBM_LOG_E("bo:%p, the user memory has no fd", bo_android);
+			break;
+		}
+
+		if (bo_android->handler->numFds < 1) {
+			TBM_LOG_E("bo:%p, the handle has no fd", bo_android);
+			break;
+		}
+
+		_android_bo_flush(gralloc_module, bo_android);
+
+		bo_handle.u32 = bo_android->handler->data[0];
+
+		DBG("device:%s, bo_handle.u32:%u", STR_DEVICE[device], bo_handle.u32);
+
+		break;
+	default:
+		TBM_LOG_E("Not supported device:%d\n", device);
 		bo_handle.ptr = NULL;
 		break;
 	}
 
+	/* the device may fail to import the buffer allocated without its usage */
+	usage = _get_usage_from_device(device);
+	if (bo_handle.ptr && usage && !(bo_android->flags_android & usage))
+		DBG("bo:%p is allocated without the usage of device:%s, usage:0x%x",
+			bo_android, STR_DEVICE[device], bo_android->flags_android);
+
+	return bo_handle;
+}
+
+/**
+ * @brief take the map reference of the bo if it's already mapped.
+ * @note The reference is taken without any lock, it can't race with the last
+ * unmap because the counter is never incremented from 0 here.
+ * @return 1 if the reference has been taken, otherwise 0.
+ */
+static int
+_android_bo_ref_mapped(tbm_bo_android bo_android)
+{
+	unsigned int cnt;
+
+	/* ordered with the relock, see _android_bo_cpu_lock */
+	cnt = __atomic_load_n(&bo_android->map_cnt, __ATOMIC_ACQUIRE);
+	while (cnt) {
+		if (__atomic_compare_exchange_n(&bo_android->map_cnt, &cnt, cnt + 1, 0,
+										__ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* @brief take the map reference of the bo */
+static void
+_android_bo_ref(tbm_bo_android bo_android)
+{
+	/* only the first map is serialized with the last unmap */
+	if (_android_bo_ref_mapped(bo_android))
+		return;
+
+	pthread_mutex_lock(&bo_android->lock);
+	__atomic_add_fetch(&bo_android->map_cnt, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&bo_android->lock);
+}
+
+/**
+ * @brief drop the map reference of the bo, the last one unlocks the buffer.
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+static int
+_android_bo_unref_mapped(const gralloc_module_t *gralloc_module,
+						 tbm_bo_android bo_android)
+{
+	unsigned int cnt;
+	int ret = 1;
+
+	/* fast path: it isn't the last reference */
+	cnt = __atomic_load_n(&bo_android->map_cnt, __ATOMIC_ACQUIRE);
+	while (cnt > 1) {
+		if (__atomic_compare_exchange_n(&bo_android->map_cnt, &cnt, cnt - 1, 0,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+
+	pthread_mutex_lock(&bo_android->lock);
+
+	if (!__atomic_load_n(&bo_android->map_cnt, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&bo_android->lock);
+		TBM_LOG_E("The buffer is not mapped");
+		return 0;
+	}
+
+	/*
+	 * A concurrent lock-free map can still take a reference meanwhile.
+	 * The persistently mapped buffer stays locked until a device access.
+	 */
+	if (__atomic_sub_fetch(&bo_android->map_cnt, 1, __ATOMIC_ACQ_REL) == 0 &&
+		bo_android->pBase && !bo_android->persistent) {
+		if (!_android_bo_unlock(gralloc_module, bo_android)) {
+			ret = 0;
+		} else {
+			__atomic_store_n(&bo_android->lock_full, 0, __ATOMIC_RELEASE);
+			__atomic_store_n(&bo_android->pBase, NULL, __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_mutex_unlock(&bo_android->lock);
+
+	return ret;
+}
+
+static uint64_t
+_get_time_in_ms(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+/* releases the queued buffers, returns the amount of them */
+static unsigned int
+_reclaim_release(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_reclaim *reclaim = &bufmgr_android->reclaim;
+	struct _tbm_android_reclaim_entry *entries, *entry;
+	unsigned int cnt = 0;
+
+	/* the only consumer takes the whole stack, so there's no ABA problem */
+	entries = __atomic_exchange_n(&reclaim->head, NULL, __ATOMIC_ACQUIRE);
+
+	while (entries) {
+		entry = entries;
+		entries = entry->next;
+
+		bufmgr_android->alloc_dev->free(bufmgr_android->alloc_dev,
+										entry->handler);
+		free(entry);
+		cnt++;
+	}
+
+	__atomic_sub_fetch(&reclaim->depth, cnt, __ATOMIC_RELEASE);
+
+	return cnt;
+}
+
+/**
+ * @brief free the gralloc buffer.
+ * @note With TBM_BACKEND_DEFERRED_FREE=1 the buffer is queued for the reclaim
+ * worker, if the queue is full the buffer is freed in place.
+ */
+static void
+_android_buffer_free(tbm_bufmgr_android bufmgr_android, buffer_handle_t handler)
+{
+	struct _tbm_android_reclaim *reclaim = &bufmgr_android->reclaim;
+	struct _tbm_android_reclaim_entry *entry;
+
+	if (!reclaim->enabled)
+		goto free_now;
+
+	if (__atomic_add_fetch(&reclaim->depth, 1, __ATOMIC_ACQ_REL) >
+		reclaim->depth_max) {
+		__atomic_sub_fetch(&reclaim->depth, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&reclaim->overflows, 1, __ATOMIC_RELAXED);
+		goto free_now;
+	}
+
+	entry = malloc(sizeof(struct _tbm_android_reclaim_entry));
+	if (!entry) {
+		__atomic_sub_fetch(&reclaim->depth, 1, __ATOMIC_RELEASE);
+		goto free_now;
+	}
+
+	entry->handler = handler;
+	entry->next = __atomic_load_n(&reclaim->head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&reclaim->head, &entry->next, entry, 1,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	__atomic_add_fetch(&reclaim->deferred, 1, __ATOMIC_RELAXED);
+	sem_post(&reclaim->sem);
+
+	return;
+
+free_now:
+	bufmgr_android->alloc_dev->free(bufmgr_android->alloc_dev, handler);
+}
+
+/* stops the worker, the queued buffers are released before the return */
+static void
+_reclaim_deinit(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_reclaim *reclaim = &bufmgr_android->reclaim;
+
+	if (!reclaim->running)
+		return;
+
+	__atomic_store_n(&reclaim->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&reclaim->sem);
+	pthread_join(reclaim->thread, NULL);
+
+	reclaim->running = 0;
+	reclaim->enabled = 0;
+	_reclaim_release(bufmgr_android);
+
+	TBM_LOG_I("reclaim deferred:%lu, batches:%lu, overflows:%lu",
+			  reclaim->deferred, reclaim->batches, reclaim->overflows);
+
+	sem_destroy(&reclaim->sem);
+}
+
+static void
+_pool_init(struct _tbm_android_pool *pool)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pool->bucket_max = _get_env_ull("TBM_BACKEND_POOL_BUCKET_MAX",
+									ANDROID_POOL_BUCKET_MAX_DEFAULT);
+	pool->bytes_max = _get_env_ull("TBM_BACKEND_POOL_BYTES_MAX",
+								   ANDROID_POOL_BYTES_MAX_DEFAULT);
+	pool->idle_ms = _get_env_ull("TBM_BACKEND_POOL_IDLE_MS",
+								 ANDROID_POOL_IDLE_MS_DEFAULT);
+
+	DBG("bucket_max:%u, bytes_max:%llu, idle_ms:%u", pool->bucket_max,
+		(unsigned long long)pool->bytes_max, pool->idle_ms);
+}
+
+/* unlinks the oldest entry of the pool, must be called with the pool lock held */
+static struct _tbm_android_pool_entry *
+_pool_unlink_oldest(struct _tbm_android_pool *pool)
+{
+	struct _tbm_android_pool_bucket *bucket, *oldest_bucket = NULL;
+	struct _tbm_android_pool_entry **link, **oldest_link = NULL;
+	struct _tbm_android_pool_entry *entry;
+
+	for (bucket = pool->buckets; bucket; bucket = bucket->next) {
+		if (!bucket->entries)
+			continue;
+
+		/* the tail of the bucket is its oldest entry */
+		for (link = &bucket->entries; (*link)->next; link = &(*link)->next)
+			;
+
+		if (!oldest_link || (*link)->stamp < (*oldest_link)->stamp) {
+			oldest_link = link;
+			oldest_bucket = bucket;
+		}
+	}
+
+	if (!oldest_link)
+		return NULL;
+
+	entry = *oldest_link;
+	*oldest_link = NULL;
+	oldest_bucket->cnt--;
+	pool->bytes -= entry->size;
+
+	return entry;
+}
+
+/* unlinks the entries which have to leave the pool according to the limits,
+ * must be called with the pool lock held */
+static struct _tbm_android_pool_entry *
+_pool_trim(struct _tbm_android_pool *pool, uint64_t bytes_max, uint64_t now)
+{
+	struct _tbm_android_pool_bucket *bucket;
+	struct _tbm_android_pool_entry **link, *entry, *evicted = NULL;
+
+	if (pool->idle_ms) {
+		for (bucket = pool->buckets; bucket; bucket = bucket->next) {
+			link = &bucket->entries;
+			while (*link) {
+				entry = *link;
+				if (entry->prewarmed || now - entry->stamp < pool->idle_ms) {
+					link = &entry->next;
+					continue;
+				}
+
+				*link = entry->next;
+				bucket->cnt--;
+				pool->bytes -= entry->size;
+
+				entry->next = evicted;
+				evicted = entry;
+			}
+		}
+	}
+
+	while (pool->bytes > bytes_max) {
+		entry = _pool_unlink_oldest(pool);
+		if (!entry)
+			break;
+
+		entry->next = evicted;
+		evicted = entry;
+	}
+
+	return evicted;
+}
+
+/* frees the buffers unlinked from the pool, the pool lock must not be held */
+static void
+_pool_release(tbm_bufmgr_android bufmgr_android,
+			  struct _tbm_android_pool_entry *entries)
+{
+	struct _tbm_android_pool_entry *entry;
+	unsigned long cnt = 0;
+
+	while (entries) {
+		entry = entries;
+		entries = entry->next;
+
+		_android_buffer_free(bufmgr_android, entry->handler);
+		free(entry);
+		cnt++;
+	}
+
+	if (!cnt)
+		return;
+
+	pthread_mutex_lock(&bufmgr_android->pool.lock);
+	bufmgr_android->pool.evictions += cnt;
+	pthread_mutex_unlock(&bufmgr_android->pool.lock);
+
+	DBG("evicted:%lu", cnt);
+}
+
+/* @brief takes a buffer matching the parameters out of the pool.
+ * @return 1 if a buffer has been found, otherwise 0.
+ */
+static int
+_pool_get(tbm_bufmgr_android bufmgr_android, int width, int height,
+		  int android_format, int android_flags, buffer_handle_t *handler,
+		  int *stride)
+{
+	struct _tbm_android_pool *pool = &bufmgr_android->pool;
+	struct _tbm_android_pool_bucket *bucket;
+	struct _tbm_android_pool_entry *entry = NULL, *evicted;
+
+	if (!pool->bucket_max)
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	evicted = _pool_trim(pool, pool->bytes_max, _get_time_in_ms());
+
+	for (bucket = pool->buckets; bucket; bucket = bucket->next) {
+		if (bucket->width == width && bucket->height == height &&
+			bucket->format_android == android_format &&
+			bucket->flags_android == android_flags)
+			break;
+	}
+
+	if (bucket && bucket->entries) {
+		entry = bucket->entries;
+		bucket->entries = entry->next;
+		bucket->cnt--;
+		pool->bytes -= entry->size;
+		pool->hits++;
+		if (entry->prewarmed)
+			pool->prewarmed_used++;
+	} else {
+		pool->misses++;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	_pool_release(bufmgr_android, evicted);
+
+	if (!entry)
+		return 0;
+
+	*handler = entry->handler;
+	*stride = entry->stride;
+	free(entry);
+
+	return 1;
+}
+
+/* @brief gives the buffer to the pool.
+ * @param[in] bucket_max : the amount of buffers the bucket can hold
+ * @param[in] prewarmed : the buffer is allocated by the prewarm, it's kept
+ * until it's used or evicted by the size limit
+ * @return 1 if the pool has taken the buffer, otherwise 0 and the caller
+ * has to free the buffer by itself.
+ */
+static int
+_pool_add(tbm_bufmgr_android bufmgr_android, int width, int height,
+		  int android_format, int android_flags, buffer_handle_t handler,
+		  int stride, uint32_t size, unsigned int bucket_max, int prewarmed)
+{
+	struct _tbm_android_pool *pool = &bufmgr_android->pool;
+	struct _tbm_android_pool_bucket *bucket;
+	struct _tbm_android_pool_entry *entry, *evicted;
+	uint64_t now, bytes;
+
+	/* the buffer bigger than the whole pool would never be trimmed */
+	if (size > pool->bytes_max)
+		return 0;
+
+	entry = calloc(1, sizeof(struct _tbm_android_pool_entry));
+	if (!entry)
+		return 0;
+
+	now = _get_time_in_ms();
+
+	entry->handler = handler;
+	entry->stride = stride;
+	entry->size = size;
+	entry->stamp = now;
+	entry->prewarmed = prewarmed;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (bucket = pool->buckets; bucket; bucket = bucket->next) {
+		if (bucket->width == width &&
+			bucket->height == height &&
+			bucket->format_android == android_format &&
+			bucket->flags_android == android_flags)
+			break;
+	}
+
+	if (!bucket) {
+		bucket = calloc(1, sizeof(struct _tbm_android_pool_bucket));
+		if (!bucket) {
+			pthread_mutex_unlock(&pool->lock);
+			free(entry);
+			return 0;
+		}
+
+		bucket->width = width;
+		bucket->height = height;
+		bucket->format_android = android_format;
+		bucket->flags_android = android_flags;
+		bucket->next = pool->buckets;
+		pool->buckets = bucket;
+	}
+
+	if (bucket->cnt >= bucket_max) {
+		pthread_mutex_unlock(&pool->lock);
+		free(entry);
+		return 0;
+	}
+
+	/* make room for the new entry before it joins the pool */
+	evicted = _pool_trim(pool, pool->bytes_max - entry->size, now);
+
+	entry->next = bucket->entries;
+	bucket->entries = entry;
+	bucket->cnt++;
+	pool->bytes += entry->size;
+	if (prewarmed)
+		pool->prewarmed++;
+	bytes = pool->bytes;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	_pool_release(bufmgr_android, evicted);
+
+	DBG("handler:%p, prewarmed:%d, pool bytes:%llu", handler, prewarmed,
+		(unsigned long long)bytes);
+
+	return 1;
+}
+
+/* @brief gives the buffer of the bo to the pool.
+ * @return 1 if the pool has taken the buffer, otherwise 0 and the caller
+ * has to free the buffer by itself.
+ */
+static int
+_pool_put(tbm_bufmgr_android bufmgr_android, tbm_bo_android bo_android)
+{
+	struct _tbm_android_pool *pool = &bufmgr_android->pool;
+
+	if (!pool->bucket_max || bo_android->imported || bo_android->pBase)
+		return 0;
+
+	return _pool_add(bufmgr_android, bo_android->width, bo_android->height,
+					 bo_android->format_android, bo_android->flags_android,
+					 bo_android->handler, bo_android->stride,
+					 bo_android->layout.size, pool->bucket_max, 0);
+}
+
+/* evicts the idle buffers of the pool, called by the reclaim worker */
+static void
+_pool_trim_idle(tbm_bufmgr_android bufmgr_android, uint64_t now)
+{
+	struct _tbm_android_pool *pool = &bufmgr_android->pool;
+	struct _tbm_android_pool_entry *evicted;
+
+	pthread_mutex_lock(&pool->lock);
+	evicted = _pool_trim(pool, pool->bytes_max, now);
+	pthread_mutex_unlock(&pool->lock);
+
+	_pool_release(bufmgr_android, evicted);
+}
+
+static void *
+_reclaim_worker(void *data)
+{
+	tbm_bufmgr_android bufmgr_android = data;
+	struct _tbm_android_reclaim *reclaim = &bufmgr_android->reclaim;
+	struct timespec ts;
+	uint64_t now, next = 0;
+	unsigned int cnt;
+	int ret, failed = 0;
+
+	while (!__atomic_load_n(&reclaim->stop, __ATOMIC_ACQUIRE)) {
+		if (reclaim->trim_ms) {
+			/* the idle buffers leave the pool at most trim_ms late, even if
+			 * nothing is allocated or freed meanwhile */
+			now = _get_time_in_ms();
+			if (now >= next) {
+				_pool_trim_idle(bufmgr_android, now);
+				next = now + reclaim->trim_ms;
+			}
+
+			/* sem_timedwait takes the deadline on CLOCK_REALTIME */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (next - now) / 1000;
+			ts.tv_nsec += ((next - now) % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+
+			ret = sem_timedwait(&reclaim->sem, &ts);
+		} else {
+			ret = sem_wait(&reclaim->sem);
+		}
+
+		if (ret) {
+			if (errno == EINTR || errno == ETIMEDOUT)
+				continue;
+
+			/* the semaphore is broken, the queue is polled instead of spinning */
+			if (!failed)
+				TBM_LOG_E("Cannot wait for the reclaim semaphore: %m, poll the queue");
+			failed = 1;
+			usleep(ANDROID_RECLAIM_BACKOFF_US);
+		}
+
+		/* the buffers queued meanwhile are released in one batch */
+		cnt = _reclaim_release(bufmgr_android);
+		if (cnt) {
+			reclaim->batches++;
+			DBG("released:%u", cnt);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief start the reclaim worker.
+ * @note The worker runs if the freed buffers are deferred
+ * (TBM_BACKEND_DEFERRED_FREE=1) or if the pool buffers become idle
+ * (TBM_BACKEND_POOL_IDLE_MS), the pool must be initialized before.
+ */
+static void
+_reclaim_init(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_reclaim *reclaim = &bufmgr_android->reclaim;
+	struct _tbm_android_pool *pool = &bufmgr_android->pool;
+
+	if (_get_env_ull("TBM_BACKEND_DEFERRED_FREE", 0))
+		reclaim->depth_max = _get_env_ull("TBM_BACKEND_DEFERRED_FREE_DEPTH",
+										  ANDROID_RECLAIM_DEPTH_DEFAULT);
+
+	if (pool->bucket_max)
+		reclaim->trim_ms = pool->idle_ms;
+
+	if (!reclaim->depth_max && !reclaim->trim_ms)
+		return;
+
+	if (sem_init(&reclaim->sem, 0, 0)) {
+		TBM_LOG_W("Cannot init the reclaim semaphore: %m");
+		reclaim->trim_ms = 0;
+		return;
+	}
+
+	if (pthread_create(&reclaim->thread, NULL, _reclaim_worker, bufmgr_android)) {
+		TBM_LOG_W("Cannot create the reclaim worker, buffers are freed in place");
+		sem_destroy(&reclaim->sem);
+		reclaim->trim_ms = 0;
+		return;
+	}
+
+	reclaim->running = 1;
+	reclaim->enabled = reclaim->depth_max != 0;
+
+	DBG("depth_max:%u, trim_ms:%u", reclaim->depth_max, reclaim->trim_ms);
+}
+
+static void
+_pool_deinit(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_pool *pool = &bufmgr_android->pool;
+	struct _tbm_android_pool_bucket *bucket;
+	struct _tbm_android_pool_entry *evicted;
+
+	pthread_mutex_lock(&pool->lock);
+	evicted = _pool_trim(pool, 0, _get_time_in_ms());
+	pthread_mutex_unlock(&pool->lock);
+
+	_pool_release(bufmgr_android, evicted);
+
+	while (pool->buckets) {
+		bucket = pool->buckets;
+		pool->buckets = bucket->next;
+		free(bucket);
+	}
+
+	TBM_LOG_I("pool hits:%lu, misses:%lu, evictions:%lu, prewarmed:%lu, used:%lu",
+			  pool->hits, pool->misses, pool->evictions, pool->prewarmed,
+			  pool->prewarmed_used);
+
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/* parses the format given as the number or as the fourcc, e.g. "AB24" */
+static uint32_t
+_prewarm_parse_format(const char *str, char **end)
+{
+	uint32_t format;
+
+	if (str[0] >= '0' && str[0] <= '9')
+		return strtoul(str, end, 0);
+
+	if (strnlen(str, 4) < 4) {
+		*end = (char *)str;
+		return 0;
+	}
+
+	format = (uint32_t)str[0] | ((uint32_t)str[1] << 8) |
+			 ((uint32_t)str[2] << 16) | ((uint32_t)str[3] << 24);
+	*end = (char *)str + 4;
+
+	return format;
+}
+
+/**
+ * @brief read the prewarm profile.
+ * @note TBM_BACKEND_PREWARM lists the surfaces separated by ';' as
+ * <width>x<height>:<tbm format>[:<tbm flags>[:<count>]], e.g.
+ * "1920x1080:AB24:1:3;1280x720:NV12".
+ * @return the amount of the surface kinds to prewarm.
+ */
+static int
+_prewarm_parse(struct _tbm_android_prewarm *prewarm)
+{
+	struct _tbm_android_prewarm_item *item;
+	uint32_t tbm_format;
+	int tbm_flags, count;
+	char *env, *str, *end;
+
+	env = getenv("TBM_BACKEND_PREWARM");
+	if (!env)
+		return 0;
+
+	for (str = env; *str && prewarm->cnt < ANDROID_PREWARM_MAX; str = end) {
+		item = &prewarm->items[prewarm->cnt];
+		tbm_flags = TBM_BO_DEFAULT;
+		count = 1;
+
+		item->width = strtol(str, &end, 0);
+		if (*end != 'x')
+			goto fail;
+		item->height = strtol(end + 1, &end, 0);
+		if (*end != ':')
+			goto fail;
+		tbm_format = _prewarm_parse_format(end + 1, &end);
+		if (*end == ':')
+			tbm_flags = strtol(end + 1, &end, 0);
+		if (*end == ':')
+			count = strtol(end + 1, &end, 0);
+		if (*end && *end != ';')
+			goto fail;
+		if (*end)
+			end++;
+
+		item->android_format = _get_android_format_from_tbm(tbm_format);
+		item->android_flags = _get_android_flags_from_tbm(tbm_flags);
+		if (item->width <= 0 || item->height <= 0 || count <= 0 ||
+			item->android_format < 0 || item->android_flags < 0) {
+			TBM_LOG_W("the prewarm surface %dx%d format:0x%x flags:%d count:%d"
+					  " is skipped", item->width, item->height, tbm_format,
+					  tbm_flags, count);
+			continue;
+		}
+
+		item->count = count;
+		prewarm->cnt++;
+	}
+
+	return prewarm->cnt;
+
+fail:
+	TBM_LOG_W("wrong TBM_BACKEND_PREWARM at \"%s\"", str);
+
+	return prewarm->cnt;
+}
+
+static void *
+_prewarm_worker(void *data)
+{
+	tbm_bufmgr_android bufmgr_android = data;
+	struct _tbm_android_prewarm *prewarm = &bufmgr_android->prewarm;
+	alloc_device_t *alloc_dev;
+	struct _tbm_android_prewarm_item *item;
+	struct _tbm_android_layout layout;
+	buffer_handle_t handler;
+	int i, j, stride;
+
+	if (!_android_gralloc_open(bufmgr_android))
+		return NULL;
+
+	alloc_dev = bufmgr_android->alloc_dev;
+
+	for (i = 0; i < prewarm->cnt; i++) {
+		item = &prewarm->items[i];
+
+		for (j = 0; j < item->count; j++) {
+			if (__atomic_load_n(&prewarm->stop, __ATOMIC_ACQUIRE))
+				return NULL;
+
+			if (alloc_dev->alloc(alloc_dev, item->width, item->height,
+								 item->android_format, item->android_flags,
+								 &handler, &stride)) {
+				TBM_LOG_W("Cannot prewarm a buffer(%dx%d)", item->width,
+						  item->height);
+				break;
+			}
+
+			if (!_tbm_android_surface_calc_data(item->width, item->height,
+												item->android_format, stride,
+												&layout)) {
+				_android_buffer_free(bufmgr_android, handler);
+				break;
+			}
+
+			_tbm_android_surface_set_data(item->width, item->height,
+										  item->android_format, &layout);
+
+			if (!_pool_add(bufmgr_android, item->width, item->height,
+						   item->android_format, item->android_flags, handler,
+						   stride, layout.size,
+						   bufmgr_android->pool.bucket_max + item->count, 1)) {
+				_android_buffer_free(bufmgr_android, handler);
+				break;
+			}
+		}
+
+		DBG("prewarmed %dx%d, android_format:%d, android_flags:%d, count:%d",
+			item->width, item->height, item->android_format,
+			item->android_flags, j);
+	}
+
+	return NULL;
+}
+
+/* starts the prewarm of the pool in the background if there's a profile */
+static void
+_prewarm_init(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_prewarm *prewarm = &bufmgr_android->prewarm;
+
+	if (!bufmgr_android->pool.bucket_max || !_prewarm_parse(prewarm))
+		return;
+
+	if (pthread_create(&prewarm->thread, NULL, _prewarm_worker, bufmgr_android)) {
+		TBM_LOG_W("Cannot create the prewarm thread");
+		return;
+	}
+
+	prewarm->running = 1;
+}
+
+static void
+_prewarm_deinit(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_prewarm *prewarm = &bufmgr_android->prewarm;
+
+	if (!prewarm->running)
+		return;
+
+	__atomic_store_n(&prewarm->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(prewarm->thread, NULL);
+	prewarm->running = 0;
+}
+
+static void
+_import_cache_init(struct _tbm_android_import_cache *cache)
+{
+	pthread_mutex_init(&cache->lock, NULL);
+}
+
+static int
+_import_key_get(const native_handle_t *native_handle,
+				struct _tbm_android_import_key *key)
+{
+	struct stat st;
+	uint64_t hash = 14695981039346656037ULL;
+	int i;
+
+	if (native_handle->numFds < 1 || fstat(native_handle->data[0], &st))
+		return 0;
+
+	/* FNV-1a */
+	for (i = 0; i < native_handle->numInts; i++) {
+		hash ^= (uint32_t)native_handle->data[native_handle->numFds + i];
+		hash *= 1099511628211ULL;
+	}
+
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->num_fds = native_handle->numFds;
+	key->num_ints = native_handle->numInts;
+	key->ints_hash = hash;
+
+	return 1;
+}
+
+static int
+_import_key_equal(const struct _tbm_android_import_key *a,
+				  const struct _tbm_android_import_key *b)
+{
+	return a->dev == b->dev && a->ino == b->ino &&
+		   a->num_fds == b->num_fds && a->num_ints == b->num_ints &&
+		   a->ints_hash == b->ints_hash;
+}
+
+static unsigned int
+_import_cache_idx(const struct _tbm_android_import_key *key)
+{
+	return (unsigned int)((key->ino ^ key->ints_hash) %
+						  ANDROID_IMPORT_CACHE_SIZE);
+}
+
+static unsigned int
+_import_cache_handle_idx(const native_handle_t *native_handle)
+{
+	return (unsigned int)(((uintptr_t)native_handle >> 4) %
+						  ANDROID_IMPORT_CACHE_SIZE);
+}
+
+/*
+ * finds the bo of the native buffer. The handle already registered by us
+ * is found by the pointer, because the gralloc may have changed its ints
+ * during the registration, so its key doesn't match any more.
+ */
+static tbm_bo_android
+_import_cache_get(tbm_bufmgr_android bufmgr_android,
+				  const native_handle_t *native_handle,
+				  const struct _tbm_android_import_key *key)
+{
+	struct _tbm_android_import_cache *cache = &bufmgr_android->import_cache;
+	tbm_bo_android bo_android;
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (bo_android = cache->bos_by_handle[_import_cache_handle_idx(native_handle)];
+		 bo_android; bo_android = bo_android->import_handle_next) {
+		if (bo_android->handler == native_handle)
+			break;
+	}
+
+	if (!bo_android) {
+		for (bo_android = cache->bos[_import_cache_idx(key)]; bo_android;
+			 bo_android = bo_android->import_next) {
+			if (_import_key_equal(&bo_android->import_key, key))
+				break;
+		}
+	}
+
+	if (bo_android)
+		cache->hits++;
+	else
+		cache->misses++;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return bo_android;
+}
+
+/*
+ * adds the just imported bo to the cache. If another thread has imported
+ * the same buffer meanwhile, its bo is returned instead.
+ */
+static tbm_bo_android
+_import_cache_add(tbm_bufmgr_android bufmgr_android, tbm_bo_android bo_android,
+				  const struct _tbm_android_import_key *key)
+{
+	struct _tbm_android_import_cache *cache = &bufmgr_android->import_cache;
+	tbm_bo_android *head = &cache->bos[_import_cache_idx(key)];
+	tbm_bo_android *handle_head;
+	tbm_bo_android cached;
+
+	handle_head = &cache->bos_by_handle[_import_cache_handle_idx(bo_android->handler)];
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (cached = *head; cached; cached = cached->import_next) {
+		if (_import_key_equal(&cached->import_key, key)) {
+			pthread_mutex_unlock(&cache->lock);
+			return cached;
+		}
+	}
+
+	bo_android->import_key = *key;
+	bo_android->import_cached = 1;
+	bo_android->import_next = *head;
+	*head = bo_android;
+	bo_android->import_handle_next = *handle_head;
+	*handle_head = bo_android;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return bo_android;
+}
+
+/* removes the bo freed by libtbm from the cache */
+static void
+_import_cache_remove(tbm_bufmgr_android bufmgr_android,
+					 tbm_bo_android bo_android)
+{
+	struct _tbm_android_import_cache *cache = &bufmgr_android->import_cache;
+	tbm_bo_android *link;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (bo_android->import_cached) {
+		link = &cache->bos[_import_cache_idx(&bo_android->import_key)];
+		while (*link != bo_android)
+			link = &(*link)->import_next;
+		*link = bo_android->import_next;
+
+		link = &cache->bos_by_handle[_import_cache_handle_idx(bo_android->handler)];
+		while (*link != bo_android)
+			link = &(*link)->import_handle_next;
+		*link = bo_android->import_handle_next;
+
+		bo_android->import_cached = 0;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void
+_import_cache_deinit(struct _tbm_android_import_cache *cache)
+{
+	TBM_LOG_I("import cache hits:%lu, misses:%lu", cache->hits, cache->misses);
+
+	pthread_mutex_destroy(&cache->lock);
+}
+
+static void
+_android_native_handle_delete(native_handle_t *native_handle)
+{
+	int i;
+
+	for (i = 0; i < native_handle->numFds; i++)
+		close(native_handle->data[i]);
+
+	free(native_handle);
+}
+
+static void
+_heap_init(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_heap *heap = &bufmgr_android->heap;
+	char path[64];
+	char *env, *end;
+	long flags;
+
+	heap->heap_fd = -1;
+
+	/* TBM_BACKEND_HEAP_FLAGS=<tbm flags>[,<tbm flags>...] */
+	env = getenv("TBM_BACKEND_HEAP_FLAGS");
+	while (env && *env) {
+		flags = strtol(env, &end, 0);
+		if (end == env || (*end && *end != ',')) {
+			TBM_LOG_W("wrong TBM_BACKEND_HEAP_FLAGS at \"%s\"", env);
+			break;
+		}
+		env = *end ? end + 1 : end;
+
+		/* the display takes only the gralloc buffers */
+		if (flags < 0 || flags > ANDROID_TBM_FLAGS_MASK ||
+			(flags & TBM_BO_SCANOUT)) {
+			TBM_LOG_W("the tbm flags:%ld can't be served by the heap", flags);
+			continue;
+		}
+
+		heap->flag_sets[flags] = 1;
+		heap->enabled = 1;
+	}
+
+	if (!heap->enabled)
+		return;
+
+	/* TBM_BACKEND_HEAP=<dma-heap name> or memfd */
+	env = getenv("TBM_BACKEND_HEAP");
+	if (!env)
+		env = ANDROID_HEAP_DEFAULT;
+
+	if (strcmp(env, "memfd")) {
+		snprintf(path, sizeof(path), ANDROID_HEAP_DIR "%s", env);
+		heap->heap_fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (heap->heap_fd < 0)
+			TBM_LOG_I("Cannot open %s: %m, the heap uses memfd", path);
+	}
+
+	TBM_LOG_I("the heap serves the buffers by %s",
+			  heap->heap_fd >= 0 ? env : "memfd");
+}
+
+static void
+_heap_deinit(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_heap *heap = &bufmgr_android->heap;
+
+	if (!heap->enabled)
+		return;
+
+	TBM_LOG_I("heap allocs:%lu, memfd:%lu", heap->allocs, heap->memfd_allocs);
+
+	if (heap->heap_fd >= 0)
+		close(heap->heap_fd);
+}
+
+/* @brief check whether the heap engine allocates the buffer of @c tbm_flags */
+static int
+_heap_serves(struct _tbm_android_heap *heap, int tbm_flags)
+{
+	return heap->enabled && !(tbm_flags & ~ANDROID_TBM_FLAGS_MASK) &&
+		   heap->flag_sets[tbm_flags];
+}
+
+/* @brief make the native handle of the heap buffer, takes the @c fd */
+static native_handle_t *
+_heap_handle_create(int fd, int kind, uint32_t size)
+{
+	native_handle_t *native_handle;
+
+	native_handle = malloc(sizeof(native_handle_t) +
+						   sizeof(int) * (1 + ANDROID_HEAP_NUM_INTS));
+	if (!native_handle) {
+		TBM_LOG_E("fail to allocate the native handle");
+		close(fd);
+		return NULL;
+	}
+
+	native_handle->version = sizeof(native_handle_t);
+	native_handle->numFds = 1;
+	native_handle->numInts = ANDROID_HEAP_NUM_INTS;
+	native_handle->data[0] = fd;
+	native_handle->data[1] = ANDROID_HEAP_MAGIC;
+	native_handle->data[2] = kind;
+	native_handle->data[3] = size;
+	memset(&native_handle->data[4], 0x0, sizeof(int) * 4);
+
+	return native_handle;
+}
+
+/**
+ * @brief allocate the buffer of @c size bytes from the dma-heap or memfd.
+ * @return the native handle of the buffer or NULL in an error case.
+ */
+static native_handle_t *
+_heap_alloc(struct _tbm_android_heap *heap, uint32_t size)
+{
+	struct _android_dma_heap_allocation_data data;
+	native_handle_t *native_handle;
+	int fd = -1, kind = ANDROID_HEAP_KIND_MEMFD;
+
+	size = ALIGN(size, PAGE_SIZE);
+
+	if (heap->heap_fd >= 0) {
+		memset(&data, 0x0, sizeof(data));
+		data.len = size;
+		data.fd_flags = O_RDWR | O_CLOEXEC;
+
+		if (!ioctl(heap->heap_fd, ANDROID_DMA_HEAP_IOCTL_ALLOC, &data)) {
+			fd = data.fd;
+			kind = ANDROID_HEAP_KIND_DMABUF;
+		} else {
+			TBM_LOG_W("Cannot allocate %u bytes from the dma-heap: %m", size);
+		}
+	}
+
+	if (fd < 0) {
+		fd = syscall(__NR_memfd_create, "tbm-android", MFD_CLOEXEC);
+		if (fd < 0) {
+			TBM_LOG_E("Cannot create the memfd: %m");
+			return NULL;
+		}
+
+		if (ftruncate(fd, size)) {
+			TBM_LOG_E("Cannot resize the memfd to %u bytes: %m", size);
+			close(fd);
+			return NULL;
+		}
+
+		__atomic_add_fetch(&heap->memfd_allocs, 1, __ATOMIC_RELAXED);
+	}
+
+	native_handle = _heap_handle_create(fd, kind, size);
+	if (!native_handle)
+		return NULL;
+
+	__atomic_add_fetch(&heap->allocs, 1, __ATOMIC_RELAXED);
+
+	return native_handle;
+}
+
+/* tears down the registration of the imported bo or releases the heap buffer */
+static void
+_android_bo_unregister(tbm_bufmgr_android bufmgr_android,
+					   tbm_bo_android bo_android)
+{
+	const gralloc_module_t *gralloc_module = bufmgr_android->gralloc_module;
+
+	if (bo_android->heap) {
+		if (bo_android->heap_map)
+			munmap(bo_android->heap_map, bo_android->handler->data[3]);
+	} else {
+		gralloc_module->unregisterBuffer(gralloc_module, bo_android->handler);
+	}
+
+	if (bo_android->owns_handle)
+		_android_native_handle_delete((native_handle_t *)bo_android->handler);
+}
+
+static void
+_slab_init(struct _tbm_android_slab *slab)
+{
+	int i;
+
+	for (i = 0; i < ANDROID_SLAB_SHARDS; i++)
+		pthread_mutex_init(&slab->shards[i].lock, NULL);
+
+	pthread_mutex_init(&slab->lock, NULL);
+}
+
+/* the free list of the calling thread */
+static unsigned int
+_slab_shard_idx(void)
+{
+	uint64_t self = (uintptr_t)pthread_self();
+
+	return (unsigned int)((self * 0x9E3779B97F4A7C15ULL) >>
+						  (64 - ANDROID_SLAB_SHARDS_BITS));
+}
+
+/* allocates a new chunk, all its bos but the returned one join the list */
+static tbm_bo_android
+_slab_grow(struct _tbm_android_slab *slab, struct _tbm_android_slab_shard *shard)
+{
+	struct _tbm_android_slab_chunk *chunk;
+	int i;
+
+	chunk = calloc(1, sizeof(struct _tbm_android_slab_chunk));
+	if (!chunk)
+		return NULL;
+
+	for (i = 1; i < ANDROID_SLAB_CHUNK_BOS - 1; i++)
+		chunk->bos[i].slab_next = &chunk->bos[i + 1];
+
+	pthread_mutex_lock(&slab->lock);
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->chunk_cnt++;
+	pthread_mutex_unlock(&slab->lock);
+
+	pthread_mutex_lock(&shard->lock);
+	chunk->bos[ANDROID_SLAB_CHUNK_BOS - 1].slab_next = shard->free_list;
+	shard->free_list = &chunk->bos[1];
+	pthread_mutex_unlock(&shard->lock);
+
+	return &chunk->bos[0];
+}
+
+/**
+ * @brief get the zeroed bo private.
+ * @note The thread takes the bos from its own free list. When it's empty,
+ * the whole list of another thread is moved to it, e.g. from the thread
+ * freeing the bos the thread allocates, the new chunk is allocated only if
+ * all the lists are empty.
+ */
+static tbm_bo_android
+_slab_get(tbm_bufmgr_android bufmgr_android)
+{
+	struct _tbm_android_slab *slab = &bufmgr_android->slab;
+	struct _tbm_android_slab_shard *home, *shard;
+	tbm_bo_android bo_android, stolen, tail;
+	unsigned long cnt, peak;
+	unsigned int idx, i;
+
+	idx = _slab_shard_idx();
+	home = &slab->shards[idx];
+
+	pthread_mutex_lock(&home->lock);
+	bo_android = home->free_list;
+	if (bo_android)
+		home->free_list = bo_android->slab_next;
+	pthread_mutex_unlock(&home->lock);
+
+	for (i = 1; !bo_android && i < ANDROID_SLAB_SHARDS; i++) {
+		shard = &slab->shards[(idx + i) & (ANDROID_SLAB_SHARDS - 1)];
+
+		pthread_mutex_lock(&shard->lock);
+		stolen = shard->free_list;
+		shard->free_list = NULL;
+		pthread_mutex_unlock(&shard->lock);
+
+		if (!stolen)
+			continue;
+
+		bo_android = stolen;
+		stolen = stolen->slab_next;
+		if (!stolen)
+			break;
+
+		for (tail = stolen; tail->slab_next; tail = tail->slab_next)
+			;
+
+		pthread_mutex_lock(&home->lock);
+		tail->slab_next = home->free_list;
+		home->free_list = stolen;
+		pthread_mutex_unlock(&home->lock);
+	}
+
+	if (!bo_android) {
+		bo_android = _slab_grow(slab, home);
+		if (!bo_android)
+			return NULL;
+	}
+
+	memset(bo_android, 0x0, sizeof(struct _tbm_bo_android));
+	bo_android->bufmgr_android = bufmgr_android;
+
+	__atomic_add_fetch(&slab->allocs, 1, __ATOMIC_RELAXED);
+	cnt = __atomic_add_fetch(&slab->in_use, 1, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&slab->peak, __ATOMIC_RELAXED);
+	while (cnt > peak &&
+		   !__atomic_compare_exchange_n(&slab->peak, &peak, cnt, 1,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	return bo_android;
+}
+
+static void
+_slab_put(tbm_bufmgr_android bufmgr_android, tbm_bo_android bo_android)
+{
+	struct _tbm_android_slab *slab = &bufmgr_android->slab;
+	struct _tbm_android_slab_shard *home;
+
+	home = &slab->shards[_slab_shard_idx()];
+
+	pthread_mutex_lock(&home->lock);
+	bo_android->slab_next = home->free_list;
+	home->free_list = bo_android;
+	pthread_mutex_unlock(&home->lock);
+
+	__atomic_sub_fetch(&slab->in_use, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief free the chunks of the bo privates.
+ * @note The bos still alive are returned to the slab by their bo_free, so
+ * the chunks and the slab itself are leaked deliberately in that case.
+ * @return 1 if the slab is freed, 0 if it's leaked.
+ */
+static int
+_slab_deinit(struct _tbm_android_slab *slab)
+{
+	struct _tbm_android_slab_chunk *chunk;
+	unsigned long in_use;
+	int i;
+
+	in_use = __atomic_load_n(&slab->in_use, __ATOMIC_ACQUIRE);
+
+	TBM_LOG_I("bo slab chunks:%lu, capacity:%lu, in use:%lu, peak:%lu, allocs:%lu",
+			  slab->chunk_cnt, slab->chunk_cnt * ANDROID_SLAB_CHUNK_BOS,
+			  in_use, slab->peak, slab->allocs);
+
+	if (in_use) {
+		TBM_LOG_W("%lu bos are still alive, leak %lu slab chunks", in_use,
+				  slab->chunk_cnt);
+		return 0;
+	}
+
+	while (slab->chunks) {
+		chunk = slab->chunks;
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+
+	for (i = 0; i < ANDROID_SLAB_SHARDS; i++)
+		pthread_mutex_destroy(&slab->shards[i].lock);
+
+	pthread_mutex_destroy(&slab->lock);
+
+	return 1;
+}
+
+/**
+ * @brief allocate the bo by the heap engine.
+ * @note The buffer has the layout libtbm has got from the plane data query.
+ * @return the bo private or NULL in an error case.
+ */
+static tbm_bo_android
+_android_heap_bo_alloc(tbm_bufmgr_android bufmgr_android, int width,
+					   int height, int tbm_format, int tbm_flags)
+{
+	const struct _tbm_android_format_desc *format_desc;
+	native_handle_t *native_handle;
+	tbm_bo_android bo_android;
+	uint32_t pitch;
+
+	format_desc = _get_format_desc_from_tbm(tbm_format);
+	if (!format_desc) {
+		TBM_LOG_E("this tbm(%d) -> android format match isn't supported!", tbm_format);
+		return NULL;
+	}
+
+	bo_android = _slab_get(bufmgr_android);
+	if (!bo_android) {
+		TBM_LOG_E("Fail to allocate the bo private");
+		return NULL;
+	}
+
+	if (!_tbm_android_surface_get_data(width, height, format_desc->android_format,
+									   &bo_android->layout)) {
+		TBM_LOG_E("Cannot get surface data");
+		_slab_put(bufmgr_android, bo_android);
+		return NULL;
+	}
+
+	native_handle = _heap_alloc(&bufmgr_android->heap, bo_android->layout.size);
+	if (!native_handle) {
+		TBM_LOG_E("Cannot allocate a buffer(%dx%d) in the heap", width, height);
+		_slab_put(bufmgr_android, bo_android);
+		return NULL;
+	}
+
+	/* the importer computes the same layout from the surface */
+	native_handle->data[4] = width;
+	native_handle->data[5] = height;
+	native_handle->data[6] = format_desc->android_format;
+	native_handle->data[7] = tbm_flags;
+
+	pitch = bo_android->layout.pitch[0];
+
+	pthread_mutex_init(&bo_android->lock, NULL);
+	bo_android->persistent = bPersistentMap;
+	bo_android->acquire_fence = -1;
+	bo_android->release_fence = -1;
+	bo_android->handler = native_handle;
+	bo_android->width = width;
+	bo_android->height = height;
+	bo_android->stride = pitch % format_desc->bpp ? 0 : pitch / format_desc->bpp;
+	bo_android->format_tbm = tbm_format;
+	bo_android->format_android = format_desc->android_format;
+	bo_android->flags_android = _get_android_flags_from_tbm(tbm_flags);
+	bo_android->flags_tbm = tbm_flags;
+	bo_android->swizzle = format_desc->swizzle;
+	bo_android->owns_handle = 1;
+	bo_android->heap = native_handle->data[2];
+
+	_stats_count(&bufmgr_android->stats.allocs);
+	_stats_bo_live(bo_android, 1);
+
+	DBG("bo:%p, handler:%p, tbm_flags:%d, tbm_format:%d, width:%d, height:%d,\n		"
+		"size:%d, heap:%d", bo_android, native_handle, tbm_flags, tbm_format,
+		width, height, bo_android->layout.size, bo_android->heap);
+
+	return bo_android;
+}
+
+static void *
+tbm_android_surface_bo_alloc(tbm_bo bo, int width, int height, int tbm_format,
+							 int tbm_flags, int bo_idx)
+{
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	int ret;
+	tbm_bo_android bo_android;
+	tbm_bufmgr_android bufmgr_android;
+	const struct _tbm_android_format_desc *format_desc;
+	int android_flags, android_format;
+	alloc_device_t *alloc_dev;
+	buffer_handle_t handler;
+	uint64_t start;
+	int stride;
+
+	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
+
+	if (_heap_serves(&bufmgr_android->heap, tbm_flags))
+		return (void *)_android_heap_bo_alloc(bufmgr_android, width, height,
+											  tbm_format, tbm_flags);
+
+	if (!_android_gralloc_open(bufmgr_android))
+		return 0;
+
+	alloc_dev = bufmgr_android->alloc_dev;
+
+	bo_android = _slab_get(bufmgr_android);
+	if (!bo_android) {
+		TBM_LOG_E("Fail to allocate the bo private");
+		return 0;
+	}
+
+	android_flags  = _get_android_flags_from_tbm(tbm_flags);
+	if (android_flags < 0) {
+		TBM_LOG_E("this tbm(%d) -> android flag match isn't supported!", tbm_flags);
+		_slab_put(bufmgr_android, bo_android);
+		return 0;
+	}
+
+	format_desc = _get_format_desc_from_tbm(tbm_format);
+	if (!format_desc) {
+		TBM_LOG_E("this tbm(%d) -> android format match isn't supported!", tbm_format);
+		_slab_put(bufmgr_android, bo_android);
+		return 0;
+	}
+	android_format = format_desc->android_format;
+
+	if (!_pool_get(bufmgr_android, width, height, android_format,
+				   android_flags, &handler, &stride)) {
+		start = _stats_now();
+		ret = alloc_dev->alloc(alloc_dev, width, height, android_format,
+				android_flags, &handler, &stride);
+		_stats_latency(bufmgr_android, TBM_ANDROID_STATS_ALLOC, start);
+		if (ret) {
+			TBM_LOG_E
+				("Cannot allocate a buffer(%dx%d) in graphic memory",
+				 width, height);
+			_slab_put(bufmgr_android, bo_android);
+			return 0;
+		}
+	}
+
+	ret = _tbm_android_surface_calc_data(width, height, android_format, stride,
+										 &bo_android->layout);
+	if (!ret) {
+		TBM_LOG_E("Cannot get surface data");
+		_android_buffer_free(bufmgr_android, handler);
+		_slab_put(bufmgr_android, bo_android);
+		return 0;
+	}
+
+	_tbm_android_surface_set_data(width, height, android_format,
+								  &bo_android->layout);
+
+	pthread_mutex_init(&bo_android->lock, NULL);
+	bo_android->persistent = bPersistentMap;
+	bo_android->acquire_fence = -1;
+	bo_android->release_fence = -1;
+	bo_android->handler = handler;
+	bo_android->width = width;
+	bo_android->height = height;
+	bo_android->stride = stride;
+	bo_android->format_tbm = tbm_format;
+	bo_android->format_android = android_format;
+	bo_android->flags_android = android_flags;
+	bo_android->flags_tbm = tbm_flags;
+	bo_android->swizzle = format_desc->swizzle;
+
+	_stats_count(&bufmgr_android->stats.allocs);
+	_stats_bo_live(bo_android, 1);
+
+	DBG("bo:%p, handler:%p, tbm_flags:%d, android_flags:%d,\n		"
+		"tbm_format:%d, android_format:%d, width:%d, height:%d, stride:%d, size:%d",
+		bo_android, handler, tbm_flags, android_flags,
+		tbm_format, android_format, width, height, stride, bo_android->layout.size);
+
+	return (void *)bo_android;
+}
+
+/**
+ * @brief get the bo private for the native handle of another process.
+ * @note The native buffer imported before gets its existing bo private,
+ * which libtbm only references, so it's registered in the gralloc once.
+ * @param[in] stride : the stride in pixels or 0 if it isn't known
+ * @param[in] owns_handle : the handle is allocated by us, the function takes
+ * the ownership of it in any case
+ * @return the bo private or NULL in an error case.
+ */
+static tbm_bo_android
+_android_bo_import_handle(tbm_bufmgr_android bufmgr_android,
+						  const native_handle_t *native_handle,
+						  int width, int height, int stride,
+						  int android_format, int android_flags, int tbm_flags,
+						  int owns_handle)
+{
+	const gralloc_module_t *gralloc_module;
+	struct _tbm_android_import_key key;
+	tbm_bo_android bo_android, cached;
+	int has_key, heap;
+	int ret;
+
+	/* the buffers of the heap engine don't need the gralloc */
+	heap = _heap_handle_kind(native_handle);
+
+	if (!heap && !_android_gralloc_open(bufmgr_android)) {
+		if (owns_handle)
+			_android_native_handle_delete((native_handle_t *)native_handle);
+		return NULL;
+	}
+
+	gralloc_module = bufmgr_android->gralloc_module;
+
+	has_key = _import_key_get(native_handle, &key);
+	if (has_key) {
+		cached = _import_cache_get(bufmgr_android, native_handle, &key);
+		if (cached) {
+			/* the bo keeps the handle of the first import, the caller's one
+			 * isn't registered and stays the caller's to close */
+			DBG("bo:%p, handler:%p is cached, the bo uses handler:%p", cached,
+				native_handle, cached->handler);
+			if (owns_handle)
+				_android_native_handle_delete((native_handle_t *)native_handle);
+			_stats_count(&bufmgr_android->stats.imports);
+			return cached;
+		}
+	}
+
+	if (!heap) {
+		ret = gralloc_module->registerBuffer(gralloc_module, native_handle);
+		if (ret) {
+			TBM_LOG_E("Cannot register buffer");
+			if (owns_handle)
+				_android_native_handle_delete((native_handle_t *)native_handle);
+			return NULL;
+		}
+	}
+
+	bo_android = _slab_get(bufmgr_android);
+	if (!bo_android) {
+		TBM_LOG_E("fail to allocate the bo private");
+		goto fail;
+	}
+
+	/*
+	 * If the stride isn't known we use the layout the gralloc has reported
+	 * for the surfaces of the same size and format or, if there were no such
+	 * allocations, the estimated one. The bare dma-buf imported by the fd
+	 * is one plane, its surface is described out of band.
+	 */
+	if (heap && !width) {
+		memset(&bo_android->layout, 0x0, sizeof(bo_android->layout));
+		bo_android->layout.size = native_handle->data[3];
+		bo_android->layout.num_planes = 1;
+		bo_android->layout.pitch[0] = native_handle->data[3];
+		bo_android->layout.plane_size[0] = native_handle->data[3];
+		ret = 1;
+	} else if (stride)
+		ret = _tbm_android_surface_calc_data(width, height, android_format,
+											 stride, &bo_android->layout);
+	else
+		ret = _tbm_android_surface_get_data(width, height, android_format,
+											&bo_android->layout);
+	if (!ret) {
+		TBM_LOG_E("Cannot get surface data");
+		_slab_put(bufmgr_android, bo_android);
+		goto fail;
+	}
+
+	if (heap && (native_handle->data[3] <= 0 ||
+				 bo_android->layout.size > (uint32_t)native_handle->data[3])) {
+		TBM_LOG_E("the heap buffer of %d bytes can't hold %u bytes",
+				  native_handle->data[3], bo_android->layout.size);
+		_slab_put(bufmgr_android, bo_android);
+		goto fail;
+	}
+
+	pthread_mutex_init(&bo_android->lock, NULL);
+	bo_android->persistent = bPersistentMap;
+	bo_android->acquire_fence = -1;
+	bo_android->release_fence = -1;
+	bo_android->handler = native_handle;
+	bo_android->width = width;
+	bo_android->height = height;
+	bo_android->stride = stride;
+	bo_android->format_tbm = _get_tbm_format_from_android(android_format);
+	bo_android->format_android = android_format;
+	bo_android->flags_android = android_flags;
+	bo_android->imported = 1;
+	bo_android->owns_handle = owns_handle;
+	bo_android->flags_tbm = tbm_flags;
+	bo_android->heap = heap;
+
+	if (has_key) {
+		cached = _import_cache_add(bufmgr_android, bo_android, &key);
+		if (cached != bo_android) {
+			/* the racing import has won, the handle is left as on a hit */
+			_android_bo_unregister(bufmgr_android, bo_android);
+			pthread_mutex_destroy(&bo_android->lock);
+			_slab_put(bufmgr_android, bo_android);
+			_stats_count(&bufmgr_android->stats.imports);
+			return cached;
+		}
+	}
+
+	_stats_count(&bufmgr_android->stats.imports);
+	_stats_bo_live(bo_android, 1);
+
+	DBG("bo:%p, handler:%p, tbm_flags:%d, android_flags:%d,\n		"
+		"width:%d, height:%d, stride:%d, android_format:%d, size:%d",
+		bo_android, native_handle, tbm_flags, android_flags,
+		width, height, stride, android_format, bo_android->layout.size);
+
+	return bo_android;
+
+fail:
+	if (!heap)
+		gralloc_module->unregisterBuffer(gralloc_module, native_handle);
+	if (owns_handle)
+		_android_native_handle_delete((native_handle_t *)native_handle);
+
+	return NULL;
+}
+
+/**
+ * @brief wrap the user memory as the bo without a copy.
+ * @note The memory has the layout gralloc would give the surface of the
+ * pitch, the cpu accesses it directly, no device but the codecs (by the fd)
+ * can use it.
+ * @return the bo private or NULL in an error case.
+ */
+static tbm_bo_android
+_android_bo_wrap(tbm_bufmgr_android bufmgr_android,
+				 const tbm_android_user_memory *memory)
+{
+	const struct _tbm_android_format_desc *desc;
+	struct _tbm_android_layout layout;
+	tbm_bo_android bo_android;
+	void *map = NULL;
+	int fd = -1;
+
+	desc = _get_format_desc_from_tbm(memory->format);
+	if (!desc) {
+		TBM_LOG_E("this tbm(%d) -> android format match isn't supported!",
+				  memory->format);
+		return NULL;
+	}
+
+	if (memory->width <= 0 || memory->height <= 0 || !memory->pitch ||
+		memory->pitch % desc->bpp || (!memory->ptr && memory->fd < 0) ||
+		(!memory->ptr && memory->offset % PAGE_SIZE)) {
+		TBM_LOG_E("wrong user memory %dx%d, pitch:%u, ptr:%p, fd:%d, offset:%u",
+				  memory->width, memory->height, memory->pitch, memory->ptr,
+				  memory->fd, memory->offset);
+		return NULL;
+	}
+
+	if (!_tbm_android_surface_calc_data(memory->width, memory->height,
+										desc->android_format,
+										memory->pitch / desc->bpp, &layout) ||
+		layout.size > memory->size) {
+		TBM_LOG_E("the user memory of %u bytes can't hold the surface %dx%d",
+				  memory->size, memory->width, memory->height);
+		return NULL;
+	}
+
+	bo_android = _slab_get(bufmgr_android);
+	if (!bo_android) {
+		TBM_LOG_E("Fail to allocate the bo private");
+		return NULL;
+	}
+
+	if (!memory->ptr) {
+		map = mmap(NULL, memory->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				   memory->fd, memory->offset);
+		if (map == MAP_FAILED) {
+			TBM_LOG_E("Cannot map the fd:%d: %m", memory->fd);
+			_slab_put(bufmgr_android, bo_android);
+			return NULL;
+		}
+
+		/* only the codecs use the fd, the bo works without it */
+		fd = fcntl(memory->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0)
+			TBM_LOG_W("Cannot duplicate the fd:%d: %m", memory->fd);
+	}
+
+	pthread_mutex_init(&bo_android->lock, NULL);
+	bo_android->acquire_fence = -1;
+	bo_android->release_fence = -1;
+	bo_android->width = memory->width;
+	bo_android->height = memory->height;
+	bo_android->stride = memory->pitch / desc->bpp;
+	bo_android->format_tbm = memory->format;
+	bo_android->format_android = desc->android_format;
+	bo_android->flags_android = _get_android_flags_from_tbm(TBM_BO_DEFAULT);
+	bo_android->flags_tbm = TBM_BO_DEFAULT;
+	bo_android->layout = layout;
+	bo_android->wrap_ptr = memory->ptr ? memory->ptr : map;
+	bo_android->wrap_map = map;
+	bo_android->wrap_size = memory->size;
+	bo_android->wrap_fd = fd;
+	bo_android->wrap_release = memory->release;
+	bo_android->wrap_data = memory->release_data;
+
+	_stats_count(&bufmgr_android->stats.imports);
+	_stats_bo_live(bo_android, 1);
+
+	DBG("bo:%p, ptr:%p, fd:%d, tbm_format:%d, width:%d, height:%d, pitch:%u",
+		bo_android, bo_android->wrap_ptr, fd, memory->format, memory->width,
+		memory->height, memory->pitch);
+
+	return bo_android;
+}
+
+/* @brief give the wrapped user memory back */
+static void
+_android_bo_unwrap(tbm_bo_android bo_android)
+{
+	if (bo_android->wrap_map) {
+		munmap(bo_android->wrap_map, bo_android->wrap_size);
+		if (bo_android->wrap_fd >= 0)
+			close(bo_android->wrap_fd);
+	}
+
+	if (bo_android->wrap_release)
+		bo_android->wrap_release(bo_android->wrap_data);
+}
+
+/* the ints of the gralloc handle up to the last one read by the import */
+#ifdef QCOM_BSP
+#define ANDROID_GRALLOC_META_INTS 11
+#else
+#define ANDROID_GRALLOC_META_INTS 8
+#endif
+
+static void *
+tbm_android_import(tbm_bo bo, const void *native)
+{
+	tbm_bufmgr_android bufmgr_android;
+	const native_handle_t* native_handle;
+
+	int tbm_flags, android_format, android_flags;
+	int width, height;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, NULL);
+	ANDROID_RETURN_VAL_IF_FAIL(native != NULL, NULL);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, NULL);
+
+	/* the user memory descriptor starts with the magic instead of the version */
+	if (*(const unsigned int *)native == TBM_ANDROID_USER_MEMORY_MAGIC)
+		return _android_bo_wrap(bufmgr_android, native);
+
+	native_handle = native;
+
+	/* the heap engine handle describes the surface by its own ints */
+	if (_heap_handle_kind(native_handle)) {
+		tbm_flags = native_handle->data[7];
+
+		return _android_bo_import_handle(bufmgr_android, native_handle,
+										 native_handle->data[4],
+										 native_handle->data[5], 0,
+										 native_handle->data[6],
+										 _get_android_flags_from_tbm(tbm_flags),
+										 tbm_flags, 0);
+	}
+
+	if (native_handle->numFds < 0 ||
+		native_handle->numInts < ANDROID_GRALLOC_META_INTS) {
+		TBM_LOG_E("the handle (fds:%d, ints:%d) has no gralloc metadata",
+				  native_handle->numFds, native_handle->numInts);
+		return NULL;
+	}
+
+	/*
+	 * TODO: must be confirmed by some documentation
+	 *
+	 * data[numFds + 4] = usage (flags) (access type)
+	 * data[numFds + 5] = width
+	 * data[numFds + 6] = height
+	 * data[numFds + 7] = format
+	 */
+#ifdef QCOM_BSP
+	/*
+	 * TODO: must find some way of getting android_flags
+	 */
+	android_flags = GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_SW_WRITE_OFTEN |
+					GRALLOC_USAGE_HW_RENDER;
+	width = native_handle->data[native_handle->numFds + 9];
+	height = native_handle->data[native_handle->numFds + 10];
+	android_format = native_handle->data[native_handle->numFds + 8];
+#else
+	android_flags = native_handle->data[native_handle->numFds + 4];
+	width = native_handle->data[native_handle->numFds + 5];
+	height = native_handle->data[native_handle->numFds + 6];
+	android_format = native_handle->data[native_handle->numFds + 7];
+#endif
+
+	tbm_flags  = _get_tbm_flags_from_android(android_flags);
+	if (tbm_flags < 0) {
+		TBM_LOG_E("this android(%d) -> tbm flag match isn't supported!", android_flags);
+		return 0;
+	}
+
+	/* The handle doesn't tell the stride in a portable way. */
+	return _android_bo_import_handle(bufmgr_android, native_handle, width,
+									 height, 0, android_format, android_flags,
+									 tbm_flags, 0);
+}
+
+static const void *
+tbm_android_export(tbm_bo bo)
+{
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, NULL);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, NULL);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, NULL);
+
+	if (bo_android->wrap_ptr) {
+		TBM_LOG_E("bo:%p, the user memory has no native handle", bo_android);
+		return NULL;
+	}
+
+	if (bo_android->heap) {
+		TBM_LOG_E("bo:%p, the heap buffer has no gralloc handle, "
+				  "export its fd", bo_android);
+		return NULL;
+	}
+
+	/* the buffer is going to be accessed by another process */
+	_android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+
+	DBG("bo:%p, handler:%p", bo_android, bo_android->handler);
+
+	return bo_android->handler;
+}
+
+/*
+ * The bo is shared as the dma-buf of its buffer (the first fd of the native
+ * handle), like with the other backends, so the fd can be mapped or passed
+ * to a driver as is. The memfd of the heap engine is shared the same way.
+ * The surface layout travels out of band, e.g. as the tbm surface info.
+ * The importer gets the bo of the bare buffer: the cpu maps it and the
+ * codecs take its fd, but it has no gralloc handle for the gpu, the native
+ * handle (bo_export_) shares the buffer with the gralloc metadata.
+ */
+static tbm_fd
+tbm_android_bo_export_fd(tbm_bo bo)
+{
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;
+	int fd;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, -1);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, -1);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, -1);
+
+	if (bo_android->wrap_ptr) {
+		if (!bo_android->wrap_map || bo_android->wrap_fd < 0) {
+			TBM_LOG_E("bo:%p, the user memory has no fd", bo_android);
+			return -1;
+		}
+
+		fd = fcntl(bo_android->wrap_fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0)
+			TBM_LOG_E("bo:%p, cannot duplicate the fd: %m", bo_android);
+
+		return fd;
+	}
+
+	if (bo_android->handler->numFds < 1) {
+		TBM_LOG_E("bo:%p, the handle has no fd", bo_android);
+		return -1;
+	}
+
+	/* the buffer is going to be accessed by another process */
+	_android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+
+	fd = fcntl(bo_android->handler->data[0], F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		TBM_LOG_E("bo:%p, cannot duplicate the fd: %m", bo_android);
+		return -1;
+	}
+
+	DBG("bo:%p, handler:%p, fd:%d", bo_android, bo_android->handler, fd);
+
+	return fd;
+}
+
+static void *
+tbm_android_bo_import_fd(tbm_bo bo, tbm_fd key)
+{
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;
+	native_handle_t *native_handle;
+	struct stat st;
+	off_t size;
+	int fd, kind;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, NULL);
+	ANDROID_RETURN_VAL_IF_FAIL(key >= 0, NULL);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, NULL);
+
+	/* the dma-buf tells its size by the seek, the memfd by the stat */
+	size = lseek(key, 0, SEEK_END);
+	if (size <= 0 && !fstat(key, &st))
+		size = st.st_size;
+	if (size <= 0 || size > INT32_MAX) {
+		TBM_LOG_E("fd:%d isn't a buffer: %m", key);
+		return NULL;
+	}
+
+	/* only the memfd has the seals */
+	kind = fcntl(key, F_GET_SEALS) >= 0 ? ANDROID_HEAP_KIND_MEMFD :
+										  ANDROID_HEAP_KIND_DMABUF;
+
+	fd = fcntl(key, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		TBM_LOG_E("fd:%d, cannot duplicate: %m", key);
+		return NULL;
+	}
+
+	native_handle = _heap_handle_create(fd, kind, size);
+	if (!native_handle)
+		return NULL;
+
+	bo_android = _android_bo_import_handle(bufmgr_android, native_handle,
+										   0, 0, 0, 0,
+										   _get_android_flags_from_tbm(TBM_BO_DEFAULT),
+										   TBM_BO_DEFAULT, 1);
+	if (!bo_android)
+		return NULL;
+
+	DBG("bo:%p, handler:%p, fd:%d, size:%ld, kind:%d", bo_android,
+		bo_android->handler, key, (long)size, kind);
+
+	return bo_android;
+}
+
+static int
+tbm_android_bo_size(tbm_bo bo)
+{
+	tbm_bo_android bo_android;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
+
+	DBG("bo:%p, size:%d", bo_android, bo_android->layout.size);
+
+	return bo_android->layout.size;
+}
+
+static void
+tbm_android_bo_free(tbm_bo bo)
+{
+	tbm_bo_android bo_android;
+	tbm_bufmgr_android bufmgr_android;
+
+	if (!bo)
+		return;
+
+	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_IF_FAIL(bufmgr_android != NULL);
+
+	bo_android = (tbm_bo_android) tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_IF_FAIL(bo_android != NULL);
+
+	_stats_count(&bufmgr_android->stats.frees);
+
+	/* libtbm frees the bo shared by the repeated imports only once */
+	if (bo_android->imported)
+		_import_cache_remove(bufmgr_android, bo_android);
+
+	/* the persistent mapping may have left the buffer locked */
+	_android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+
+	if (bo_android->wrap_ptr)
+		_android_bo_unwrap(bo_android);
+	else if (bo_android->imported || bo_android->heap)
+		_android_bo_unregister(bufmgr_android, bo_android);
+	else if (!_pool_put(bufmgr_android, bo_android))
+		_android_buffer_free(bufmgr_android, bo_android->handler);
+
+	DBG("bo:%p", bo_android);
+
+	if (bo_android->acquire_fence >= 0)
+		close(bo_android->acquire_fence);
+	if (bo_android->release_fence >= 0)
+		close(bo_android->release_fence);
+
+	_stats_bo_live(bo_android, -1);
+
+	free(bo_android->shadow);
+	pthread_mutex_destroy(&bo_android->lock);
+	_slab_put(bufmgr_android, bo_android);
+}
+
+static tbm_bo_handle
+tbm_android_bo_get_handle(tbm_bo bo, int device)
+{
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+
+	tbm_bo_handle bo_handle;
+	tbm_bo_android bo_android;
+	tbm_bufmgr_android bufmgr_android;
+
+	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, (tbm_bo_handle) NULL);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, (tbm_bo_handle) NULL);
+
+	DBG("bo:%p, handler:%p, flags_tbm:%d, size:%d", bo_android,
+		bo_android->handler, bo_android->flags_tbm, bo_android->layout.size);
+
+	/*Get mapped bo_handle*/
+	bo_handle = _android_bo_handle(bufmgr_android, bo_android, device,
+								   TBM_OPTION_READ | TBM_OPTION_WRITE);
+	if (bo_handle.ptr == NULL) {
+		TBM_LOG_E("Cannot get handle: device:%d", device);
+		return (tbm_bo_handle) NULL;
+	}
+
 	return bo_handle;
 }
 
-static void *
-tbm_android_surface_bo_alloc(tbm_bo bo, int width, int height, int tbm_format,
-							 int tbm_flags, int bo_idx)
+static tbm_bo_handle
+tbm_android_bo_map(tbm_bo bo, int device, int opt)
+{
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+
+	tbm_bo_handle bo_handle;
+	tbm_bo_android bo_android;
+	tbm_bufmgr_android bufmgr_android;
+
+	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, (tbm_bo_handle) NULL);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, (tbm_bo_handle) NULL);
+
+	/*
+	 * The device map flushes the persistent cpu mapping nobody uses, so its
+	 * own reference is taken only after the handle. The cpu map holds the
+	 * reference while it locks the buffer.
+	 */
+	if (device != TBM_DEVICE_CPU) {
+		bo_handle = _android_bo_handle(bufmgr_android, bo_android, device, opt);
+		if (bo_handle.ptr == NULL) {
+			TBM_LOG_E("Cannot get handle: device:%d", device);
+			return (tbm_bo_handle) NULL;
+		}
+
+		_android_bo_ref(bo_android);
+	} else {
+		_android_bo_ref(bo_android);
+
+		bo_handle = _android_bo_handle(bufmgr_android, bo_android, device, opt);
+		if (bo_handle.ptr == NULL) {
+			TBM_LOG_E("Cannot get handle: device:%d", device);
+			_android_bo_unref_mapped(bufmgr_android->gralloc_module, bo_android);
+			return (tbm_bo_handle) NULL;
+		}
+	}
+
+	_stats_count(&bufmgr_android->stats.maps);
+
+	DBG("bo:%p, handler:%p,\n		flags_tbm:%d, size:%d, map_cnt = %d, opt:%s",
+		bo_android, bo_android->handler, bo_android->flags_tbm,
+		bo_android->layout.size,
+		__atomic_load_n(&bo_android->map_cnt, __ATOMIC_RELAXED),
+		STR_OPT[opt & (TBM_OPTION_READ | TBM_OPTION_WRITE)]);
+
+	return bo_handle;
+}
+
+static int
+tbm_android_bo_unmap(tbm_bo bo)
 {
 	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
 
-	int ret;
 	tbm_bo_android bo_android;
 	tbm_bufmgr_android bufmgr_android;
-	int android_flags, android_format;
-	alloc_device_t *alloc_dev;
-	buffer_handle_t handler;
-	int stride;
-	uint32_t size;
+	const gralloc_module_t *gralloc_module;
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
+
+	gralloc_module = bufmgr_android->gralloc_module;
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
+
+	DBG("bo:%p, handler:%p, \n		flags_tbm:%d, size:%d, map_cnt = %d",
+		bo_android, bo_android->handler, bo_android->flags_tbm,
+		bo_android->layout.size,
+		__atomic_load_n(&bo_android->map_cnt, __ATOMIC_RELAXED));
+
+	_stats_count(&bufmgr_android->stats.unmaps);
+
+	return _android_bo_unref_mapped(gralloc_module, bo_android);
+}
+
+/**
+ * @brief wait for the cpu accesses of the bo before a device accesses it.
+ * @note In the async lock mode (TBM_BACKEND_ASYNC_LOCK=1) the unmap returns
+ * before the gralloc is done with the buffer, the release fence is waited here
+ * for the device map of libtbm. The cpu map waits for the gralloc by itself.
+ * The fence waited here isn't given by tbm_android_bo_get_release_fence.
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+static int
+tbm_android_bo_lock(tbm_bo bo, int device, int opt)
+{
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	tbm_bo_android bo_android;
+	tbm_bufmgr_android bufmgr_android;
+	int fence_fd;
+
+	if (device == TBM_DEVICE_CPU)
+		return 1;
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
+
+	if (!__atomic_load_n(&bufmgr_android->async_lock, __ATOMIC_ACQUIRE))
+		return 1;
+
+	/* the persistent mapping nobody uses is flushed by the device map anyway,
+	 * flush it here so its fence is waited too */
+	_android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+
+	pthread_mutex_lock(&bo_android->lock);
+
+	fence_fd = bo_android->release_fence;
+	bo_android->release_fence = -1;
+
+	pthread_mutex_unlock(&bo_android->lock);
+
+	DBG("bo:%p, device:%d, release_fence:%d", bo_android, device, fence_fd);
+
+	return _android_fence_wait(fence_fd);
+}
+
+tbm_bo_handle
+tbm_android_bo_map_region(tbm_bo bo, int opt, int x, int y, int width,
+						  int height)
+{
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+
+	tbm_bo_handle bo_handle;
+	tbm_bo_android bo_android;
+	tbm_bufmgr_android bufmgr_android;
+	struct _tbm_android_rect rect;
 
 	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, (tbm_bo_handle) NULL);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, (tbm_bo_handle) NULL);
+
+	ANDROID_RETURN_VAL_IF_FAIL(x >= 0 && y >= 0 && width > 0 && height > 0,
+							   (tbm_bo_handle) NULL);
+	ANDROID_RETURN_VAL_IF_FAIL(x + width <= bo_android->width &&
+							   y + height <= bo_android->height,
+							   (tbm_bo_handle) NULL);
+
+	rect.x = x;
+	rect.y = y;
+	rect.width = width;
+	rect.height = height;
+
+	_android_bo_ref(bo_android);
+
+	memset(&bo_handle, 0x0, sizeof(tbm_bo_handle));
+	bo_handle.ptr = _android_bo_cpu_map(bufmgr_android->gralloc_module,
+										bo_android, opt, &rect);
+	if (bo_handle.ptr == NULL) {
+		TBM_LOG_E("Cannot map the region %d,%d %dx%d", x, y, width, height);
+		_android_bo_unref_mapped(bufmgr_android->gralloc_module, bo_android);
+		return (tbm_bo_handle) NULL;
+	}
+
+	_stats_count(&bufmgr_android->stats.maps);
+
+	DBG("bo:%p, handler:%p, region:%d,%d %dx%d, map_cnt = %d, opt:%s",
+		bo_android, bo_android->handler, x, y, width, height,
+		__atomic_load_n(&bo_android->map_cnt, __ATOMIC_RELAXED),
+		STR_OPT[opt & (TBM_OPTION_READ | TBM_OPTION_WRITE)]);
+
+	return bo_handle;
+}
+
+int
+tbm_android_bo_unmap_region(tbm_bo bo)
+{
+	return tbm_android_bo_unmap(bo);
+}
+
+int
+tbm_android_bo_set_acquire_fence(tbm_bo bo, int fence_fd)
+{
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;
+	int old_fence_fd;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
 	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
 
-	alloc_dev = bufmgr_android->alloc_dev;
-	ANDROID_RETURN_VAL_IF_FAIL(alloc_dev != NULL, 0);
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
 
-	bo_android = calloc(1, sizeof(struct _tbm_bo_android));
-	if (!bo_android) {
-		TBM_LOG_E("Fail to allocate the bo private");
+	/* a device is going to write, drop the persistent lock */
+	_android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+
+	pthread_mutex_lock(&bo_android->lock);
+
+	if (bo_android->pBase) {
+		pthread_mutex_unlock(&bo_android->lock);
+		TBM_LOG_E("bo:%p is locked for the cpu access", bo_android);
 		return 0;
 	}
 
-	android_flags  = _get_android_flags_from_tbm(tbm_flags);
-	if (android_flags < 0) {
-		TBM_LOG_E("this tbm(%d) -> android flag match isn't supported!", tbm_flags);
-		free(bo_android);
+	old_fence_fd = bo_android->acquire_fence;
+	bo_android->acquire_fence = fence_fd;
+
+	pthread_mutex_unlock(&bo_android->lock);
+
+	/* both accesses have to be finished before the cpu one */
+	if (old_fence_fd >= 0)
+		_android_fence_wait(old_fence_fd);
+
+	DBG("bo:%p, acquire_fence:%d", bo_android, fence_fd);
+
+	return 1;
+}
+
+int
+tbm_android_bo_get_release_fence(tbm_bo bo)
+{
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;
+	int fence_fd;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, -1);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, -1);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, -1);
+
+	/* the fence of the persistent mapping is produced by the flush */
+	_android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+
+	pthread_mutex_lock(&bo_android->lock);
+
+	fence_fd = bo_android->release_fence;
+	bo_android->release_fence = -1;
+
+	pthread_mutex_unlock(&bo_android->lock);
+
+	DBG("bo:%p, release_fence:%d", bo_android, fence_fd);
+
+	return fence_fd;
+}
+
+int
+tbm_android_bo_set_persistent(tbm_bo bo, int enable)
+{
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
+
+	pthread_mutex_lock(&bo_android->lock);
+	bo_android->persistent = !!enable;
+	pthread_mutex_unlock(&bo_android->lock);
+
+	DBG("bo:%p, persistent:%d", bo_android, !!enable);
+
+	if (!enable)
+		return _android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+
+	return 1;
+}
+
+int
+tbm_android_bo_flush(tbm_bo bo)
+{
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
+
+	return _android_bo_flush(bufmgr_android->gralloc_module, bo_android);
+}
+
+int
+tbm_android_bo_set_surface(tbm_bo bo, int width, int height,
+						   uint32_t tbm_format, uint32_t pitch)
+{
+	const struct _tbm_android_format_desc *desc;
+	struct _tbm_android_layout layout;
+	tbm_bo_android bo_android;
+	int ret;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	ANDROID_RETURN_VAL_IF_FAIL(width > 0 && height > 0, 0);
+
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
+
+	if (!bo_android->heap || bo_android->width) {
+		TBM_LOG_E("bo:%p already has its surface", bo_android);
 		return 0;
 	}
 
-	android_format = _get_android_format_from_tbm(tbm_format);
-	if (android_format < 0) {
-		TBM_LOG_E("this tbm(%d) -> android format match isn't supported!", tbm_format);
-		free(bo_android);
+	desc = _get_format_desc_from_tbm(tbm_format);
+	if (!desc) {
+		TBM_LOG_E("this tbm(%d) -> android format match isn't supported!",
+				  tbm_format);
 		return 0;
 	}
 
-	ret = alloc_dev->alloc(alloc_dev, width, height, android_format,
-			android_flags, &handler, &stride);
-	if (ret) {
-		TBM_LOG_E
-			("Cannot allocate a buffer(%dx%d) in graphic memory",
-			 width, height);
-		free(bo_android);
+	if (pitch % desc->bpp) {
+		TBM_LOG_E("bo:%p, pitch:%u isn't a multiple of %d bytes", bo_android,
+				  pitch, desc->bpp);
 		return 0;
 	}
 
-	ret = _tbm_android_surface_get_data(width, height, android_format, &size, NULL);
-	if (!ret) {
-		TBM_LOG_E("Cannot get surface data");
-		free(bo_android);
+	/* the exporter's pitch is the layout its gralloc has given */
+	if (pitch)
+		ret = _tbm_android_surface_calc_data(width, height, desc->android_format,
+											 pitch / desc->bpp, &layout);
+	else
+		ret = _tbm_android_surface_get_data(width, height, desc->android_format,
+											&layout);
+	if (!ret)
+		return 0;
+
+	if (layout.size > (uint32_t)bo_android->handler->data[3]) {
+		TBM_LOG_E("the heap buffer of %d bytes can't hold %u bytes",
+				  bo_android->handler->data[3], layout.size);
 		return 0;
 	}
 
-	bo_android->handler = handler;
+	pthread_mutex_lock(&bo_android->lock);
+
+	/* the mappers keep using the layout, it's set before the first map */
+	if (__atomic_load_n(&bo_android->map_cnt, __ATOMIC_ACQUIRE) ||
+		bo_android->width) {
+		pthread_mutex_unlock(&bo_android->lock);
+		TBM_LOG_E("bo:%p is mapped or already has its surface", bo_android);
+		return 0;
+	}
+
+	bo_android->layout = layout;
+	bo_android->stride = pitch / desc->bpp;
+	bo_android->format_tbm = _get_tbm_format_from_android(desc->android_format);
+	bo_android->format_android = desc->android_format;
 	bo_android->width = width;
 	bo_android->height = height;
-	bo_android->flags_tbm = tbm_flags;
-	bo_android->size = size;
 
-	DBG("bo:%p, handler:%p, tbm_flags:%d, android_flags:%d,\n		"
-		"tbm_format:%d, android_format:%d, width:%d, height:%d, size:%d",
-		bo_android, handler, tbm_flags, android_flags,
-		tbm_format, android_format, width, height, size);
+	pthread_mutex_unlock(&bo_android->lock);
+
+	/* the plane data of the surfaces made of the bo follow the exporter's */
+	if (pitch)
+		_tbm_android_surface_set_data(width, height, desc->android_format,
+									  &layout);
+
+	DBG("bo:%p, %dx%d, format:%d, pitch:%u, size:%u", bo_android, width,
+		height, tbm_format, pitch, layout.size);
+
+	return 1;
+}
+
+/* the most buffers preallocated at once and the most threads doing it */
+#define ANDROID_PREALLOC_MAX         16
+#define ANDROID_PREALLOC_THREADS_MAX 4
+
+struct _tbm_android_prealloc {
+	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android bo_android;            /* the template */
+	int count;
+	int next;                             /* accessed atomically */
+	int failed;                           /* accessed atomically */
+	buffer_handle_t handlers[ANDROID_PREALLOC_MAX];
+	int strides[ANDROID_PREALLOC_MAX];
+};
+
+static void *
+_prealloc_worker(void *data)
+{
+	struct _tbm_android_prealloc *prealloc = data;
+	alloc_device_t *alloc_dev = prealloc->bufmgr_android->alloc_dev;
+	tbm_bo_android bo_android = prealloc->bo_android;
+	int i;
 
-	return (void *)bo_android;
+	while (!__atomic_load_n(&prealloc->failed, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&prealloc->next, 1, __ATOMIC_RELAXED);
+		if (i >= prealloc->count)
+			break;
+
+		if (alloc_dev->alloc(alloc_dev, bo_android->width, bo_android->height,
+							 bo_android->format_android,
+							 bo_android->flags_android,
+							 &prealloc->handlers[i], &prealloc->strides[i])) {
+			prealloc->handlers[i] = NULL;
+			__atomic_store_n(&prealloc->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
 }
 
-static void *
-tbm_android_import(tbm_bo bo, const void *native)
+int
+tbm_android_bo_prealloc(tbm_bo bo, int count)
 {
+	struct _tbm_android_prealloc prealloc;
+	struct _tbm_android_layout layout;
+	pthread_t threads[ANDROID_PREALLOC_THREADS_MAX - 1];
 	tbm_bufmgr_android bufmgr_android;
-	const native_handle_t* native_handle;
 	tbm_bo_android bo_android;
+	struct _tbm_android_pool *pool;
+	int nthreads = 0;
+	int i, ret = 1;
 
-	int tbm_flags, android_format, android_flags;
-	int width, height;
-	uint32_t size;
-	int ret;
-
-	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, NULL);
-	ANDROID_RETURN_VAL_IF_FAIL(native != NULL, NULL);
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
+	ANDROID_RETURN_VAL_IF_FAIL(count > 0 && count <= ANDROID_PREALLOC_MAX, 0);
 
 	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
-	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, NULL);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
 
-	native_handle = native;
-	ret = bufmgr_android->gralloc_module->registerBuffer(bufmgr_android->gralloc_module, native_handle);
-	if (ret)
-		return NULL;
+	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
+	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
 
-	bo_android = calloc(1, sizeof(struct _tbm_bo_android));
-	if (!bo_android) {
-		TBM_LOG_E("bo:%p fail to allocate the bo private", bo);
-		return NULL;
+	/* the user memory isn't a gralloc buffer, there is nothing to repeat */
+	if (bo_android->wrap_ptr) {
+		TBM_LOG_E("bo:%p, the user memory can't be preallocated", bo_android);
+		return 0;
 	}
 
-	/*
-	 * TODO: must be confirmed by some documentation
-	 *
-	 * data[numFds + 4] = usage (flags) (access type)
-	 * data[numFds + 5] = width
-	 * data[numFds + 6] = height
-	 * data[numFds + 7] = format
-	 */
-#ifdef QCOM_BSP
-	/*
-	 * TODO: must find some way of getting android_flags
-	 */
-	android_flags = GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_SW_WRITE_OFTEN |
-					GRALLOC_USAGE_HW_RENDER;
-	width = native_handle->data[native_handle->numFds + 9];
-	height = native_handle->data[native_handle->numFds + 10];
-	android_format = native_handle->data[native_handle->numFds + 8];
-#else
-	android_flags = native_handle->data[native_handle->numFds + 4];
-	width = native_handle->data[native_handle->numFds + 5];
-	height = native_handle->data[native_handle->numFds + 6];
-	android_format = native_handle->data[native_handle->numFds + 7];
-#endif
-
-	tbm_flags  = _get_tbm_flags_from_android(android_flags);
-	if (tbm_flags < 0) {
-		TBM_LOG_E("this android(%d) -> tbm flag match isn't supported!", android_flags);
-		free(bo_android);
+	pool = &bufmgr_android->pool;
+	if (bo_android->imported || bo_android->heap || !pool->bucket_max ||
+		(uint64_t)bo_android->layout.size * count > pool->bytes_max) {
+		TBM_LOG_E("bo:%p, %d buffers can't be kept in the pool", bo_android,
+				  count);
 		return 0;
 	}
 
-	ret = _tbm_android_surface_get_data(width, height, android_format, &size, NULL);
-	if (!ret) {
-		TBM_LOG_E("Cannot get surface data");
-		free(bo_android);
+	memset(&prealloc, 0x0, sizeof(prealloc));
+	prealloc.bufmgr_android = bufmgr_android;
+	prealloc.bo_android = bo_android;
+	prealloc.count = count;
+
+	/* the gralloc allocations are slow, run them in parallel */
+	while (nthreads < count - 1 && nthreads < ANDROID_PREALLOC_THREADS_MAX - 1) {
+		if (pthread_create(&threads[nthreads], NULL, _prealloc_worker, &prealloc))
+			break;
+		nthreads++;
+	}
+
+	_prealloc_worker(&prealloc);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (prealloc.failed) {
+		TBM_LOG_E("bo:%p, cannot allocate %d buffers(%dx%d)", bo_android, count,
+				  bo_android->width, bo_android->height);
+		for (i = 0; i < count; i++) {
+			if (prealloc.handlers[i])
+				_android_buffer_free(bufmgr_android, prealloc.handlers[i]);
+		}
 		return 0;
 	}
 
-	bo_android->handler = native_handle;
-	bo_android->width = width;
-	bo_android->height = height;
-	bo_android->flags_tbm = tbm_flags;
-	bo_android->size = size;
+	/* the bucket grows over its limit, the idle buffers are trimmed anyway */
+	for (i = 0; i < count; i++) {
+		if (!_tbm_android_surface_calc_data(bo_android->width,
+											bo_android->height,
+											bo_android->format_android,
+											prealloc.strides[i], &layout) ||
+			!_pool_add(bufmgr_android, bo_android->width, bo_android->height,
+					   bo_android->format_android, bo_android->flags_android,
+					   prealloc.handlers[i], prealloc.strides[i], layout.size,
+					   pool->bucket_max + count, 0)) {
+			_android_buffer_free(bufmgr_android, prealloc.handlers[i]);
+			ret = 0;
+		}
+	}
 
-	DBG("bo:%p, handler:%p, tbm_flags:%d, android_flags:%d,\n		"
-		"width:%d, height:%d, android_format:%d, size:%d",
-		bo_android, native_handle, tbm_flags, android_flags,
-		width, height, android_format, size);
+	DBG("bo:%p, count:%d, threads:%d", bo_android, count, nthreads + 1);
 
-	return bo_android;
+	return ret;
 }
 
-static const void *
-tbm_android_export(tbm_bo bo)
-{
-	tbm_bo_android bo_android;
+/*
+ * The copy and the fill are split into the bands of rows, the surfaces
+ * bigger than ANDROID_BLIT_SPLIT_BYTES are shared with the extra threads,
+ * one per ANDROID_BLIT_THREAD_BYTES. The destination bigger than the
+ * caches is written with the non-temporal stores.
+ */
+#define ANDROID_BLIT_BAND_ROWS      32
+#define ANDROID_BLIT_SPLIT_BYTES    (4 * 1024 * 1024)
+#define ANDROID_BLIT_THREAD_BYTES   (2 * 1024 * 1024)
+#define ANDROID_BLIT_THREADS_MAX    4
+#define ANDROID_BLIT_NT_BYTES       (2 * 1024 * 1024)
+
+/* the rows of a plane to copy */
+struct _tbm_android_blit_part {
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_pitch;
+	uint32_t src_pitch;   /* 0 - every row is a copy of the same source row */
+	uint32_t row_bytes;
+	int rows;
+	int first_band;       /* the index of its first band among all the parts */
+};
 
-	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, NULL);
+struct _tbm_android_blit {
+	struct _tbm_android_blit_part parts[ANDROID_MAX_PLANES];
+	int num_parts;
+	int num_bands;
+	int overlap;          /* the regions of the same buffer overlap */
+	int backward;         /* the rows are copied bottom up */
+	int nt;               /* the non-temporal stores */
+	int next;             /* the next band, accessed atomically */
+};
 
-	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
-	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, NULL);
+/* the online cpus, 0 - not known yet, accessed atomically */
+static int blit_cpus;
 
-	DBG("bo:%p, handler:%p", bo_android, bo_android->handler);
+static void
+_blit_row(uint8_t *dst, const uint8_t *src, uint32_t len, int nt)
+{
+#if defined(__SSE2__)
+	__m128i a, b, c, d;
+	uint32_t head;
+
+	if (nt && len >= 128) {
+		head = (16 - ((uintptr_t)dst & 15)) & 15;
+		memcpy(dst, src, head);
+		dst += head;
+		src += head;
+		len -= head;
+
+		for (; len >= 64; len -= 64, dst += 64, src += 64) {
+			a = _mm_loadu_si128((const __m128i *)src);
+			b = _mm_loadu_si128((const __m128i *)(src + 16));
+			c = _mm_loadu_si128((const __m128i *)(src + 32));
+			d = _mm_loadu_si128((const __m128i *)(src + 48));
+			_mm_stream_si128((__m128i *)dst, a);
+			_mm_stream_si128((__m128i *)(dst + 16), b);
+			_mm_stream_si128((__m128i *)(dst + 32), c);
+			_mm_stream_si128((__m128i *)(dst + 48), d);
+		}
+	}
+#else
+	/* the libc memcpy of arm is vectorized and streams the big copies itself */
+	(void)nt;
+#endif
 
-	return bo_android->handler;
+	memcpy(dst, src, len);
 }
 
-static int
-tbm_android_bo_size(tbm_bo bo)
+static void *
+_blit_worker(void *data)
 {
-	tbm_bo_android bo_android;
-
-	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
-
-	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
-	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
+	struct _tbm_android_blit *blit = data;
+	const struct _tbm_android_blit_part *part;
+	int band, p, row, end, y;
+
+	while ((band = __atomic_fetch_add(&blit->next, 1, __ATOMIC_RELAXED)) <
+		   blit->num_bands) {
+		for (p = blit->num_parts - 1; blit->parts[p].first_band > band; p--)
+			;
+		part = &blit->parts[p];
+
+		row = (band - part->first_band) * ANDROID_BLIT_BAND_ROWS;
+		end = row + ANDROID_BLIT_BAND_ROWS;
+		if (end > part->rows)
+			end = part->rows;
+
+		for (; row < end; row++) {
+			y = blit->backward ? part->rows - 1 - row : row;
+			if (blit->overlap)
+				memmove(part->dst + y * part->dst_pitch,
+						part->src + y * part->src_pitch, part->row_bytes);
+			else
+				_blit_row(part->dst + y * part->dst_pitch,
+						  part->src + y * part->src_pitch, part->row_bytes,
+						  blit->nt);
+		}
+	}
 
-	DBG("bo:%p, size:%d", bo_android, bo_android->size);
+#if defined(__SSE2__)
+	/* the streamed lines reach the memory before the threads are joined */
+	if (blit->nt)
+		_mm_sfence();
+#endif
 
-	return bo_android->size;
+	return NULL;
 }
 
 static void
-tbm_android_bo_free(tbm_bo bo)
+_blit_add_part(struct _tbm_android_blit *blit, uint8_t *dst, uint32_t dst_pitch,
+			   const uint8_t *src, uint32_t src_pitch, uint32_t row_bytes,
+			   int rows)
 {
-	tbm_bo_android bo_android;
-	tbm_bufmgr_android bufmgr_android;
+	struct _tbm_android_blit_part *part = &blit->parts[blit->num_parts++];
 
-	if (!bo)
-		return;
+	part->dst = dst;
+	part->dst_pitch = dst_pitch;
+	part->src = src;
+	part->src_pitch = src_pitch;
+	part->row_bytes = row_bytes;
+	part->rows = rows;
+	part->first_band = blit->num_bands;
 
-	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
-	ANDROID_RETURN_IF_FAIL(bufmgr_android != NULL);
+	blit->num_bands += (rows + ANDROID_BLIT_BAND_ROWS - 1) / ANDROID_BLIT_BAND_ROWS;
+}
 
-	bo_android = (tbm_bo_android) tbm_backend_get_bo_priv(bo);
-	ANDROID_RETURN_IF_FAIL(bo_android != NULL);
+static void
+_blit_run(struct _tbm_android_blit *blit)
+{
+	pthread_t threads[ANDROID_BLIT_THREADS_MAX - 1];
+	uint64_t bytes = 0;
+	int nthreads = 0, want, cpus;
+	int i;
+
+	for (i = 0; i < blit->num_parts; i++)
+		bytes += (uint64_t)blit->parts[i].row_bytes * blit->parts[i].rows;
+
+	/* the overlapping rows have to be copied in order */
+	if (!blit->overlap) {
+		blit->nt = bytes >= ANDROID_BLIT_NT_BYTES;
+
+		want = bytes >= ANDROID_BLIT_SPLIT_BYTES ?
+			   (int)(bytes / ANDROID_BLIT_THREAD_BYTES) : 1;
+		if (want > 1) {
+			cpus = __atomic_load_n(&blit_cpus, __ATOMIC_RELAXED);
+			if (!cpus) {
+				cpus = sysconf(_SC_NPROCESSORS_ONLN);
+				if (cpus < 1)
+					cpus = 1;
+				__atomic_store_n(&blit_cpus, cpus, __ATOMIC_RELAXED);
+			}
+			want = MIN(want, cpus);
+		}
+		while (nthreads < want - 1 && nthreads < ANDROID_BLIT_THREADS_MAX - 1 &&
+			   nthreads < blit->num_bands - 1) {
+			if (pthread_create(&threads[nthreads], NULL, _blit_worker, blit))
+				break;
+			nthreads++;
+		}
+	}
 
-	bufmgr_android->alloc_dev->free(bufmgr_android->alloc_dev,
-									bo_android->handler);
+	_blit_worker(blit);
 
-	DBG("bo:%p", bo_android);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
 
-	free(bo_android);
+	DBG("bytes:%llu, bands:%d, threads:%d, nt:%d", (unsigned long long)bytes,
+		blit->num_bands, nthreads + 1, blit->nt);
 }
 
-static tbm_bo_handle
-tbm_android_bo_get_handle(tbm_bo bo, int device)
+static int
+_rect_in_bo(tbm_bo_android bo_android, const struct _tbm_android_rect *rect)
 {
-	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+	return rect->x >= 0 && rect->y >= 0 && rect->width > 0 && rect->height > 0 &&
+		   rect->x + rect->width <= bo_android->width &&
+		   rect->y + rect->height <= bo_android->height;
+}
 
-	tbm_bo_handle bo_handle;
-	tbm_bo_android bo_android;
+int
+tbm_android_bo_copy(tbm_bo dst, int dst_x, int dst_y, tbm_bo src, int src_x,
+					int src_y, int width, int height)
+{
+	const struct _tbm_android_format_desc *desc;
+	struct _tbm_android_rect dst_rect, src_rect;
+	struct _tbm_android_blit blit;
 	tbm_bufmgr_android bufmgr_android;
+	tbm_bo_android dst_android, src_android;
+	uint8_t *dst_map, *src_map;
+	uint32_t dst_pitch, src_pitch, dst_rows, src_rows;
+	int same, i;
 
-	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
-	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, (tbm_bo_handle) NULL);
+	ANDROID_RETURN_VAL_IF_FAIL(dst != NULL, 0);
+	ANDROID_RETURN_VAL_IF_FAIL(src != NULL, 0);
 
-	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
-	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, (tbm_bo_handle) NULL);
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(dst);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
 
-	DBG("bo:%p, handler:%p, flags_tbm:%d, size:%d", bo_android,
-		bo_android->handler, bo_android->flags_tbm, bo_android->size);
+	dst_android = (tbm_bo_android)tbm_backend_get_bo_priv(dst);
+	ANDROID_RETURN_VAL_IF_FAIL(dst_android != NULL, 0);
+	src_android = (tbm_bo_android)tbm_backend_get_bo_priv(src);
+	ANDROID_RETURN_VAL_IF_FAIL(src_android != NULL, 0);
+
+	/* the imported bo has the first tbm format of its memory format */
+	if (dst_android->format_android != src_android->format_android ||
+		dst_android->swizzle != src_android->swizzle) {
+		TBM_LOG_E("bo:%p, format:%d can't be copied to bo:%p, format:%d",
+				  src_android, src_android->format_tbm, dst_android,
+				  dst_android->format_tbm);
+		return 0;
+	}
 
-	/*Get mapped bo_handle*/
-	bo_handle = _android_bo_handle(bufmgr_android, bo_android, device);
-	if (bo_handle.ptr == NULL) {
-		TBM_LOG_E("Cannot get handle: device:%s", STR_DEVICE[device]);
-		return (tbm_bo_handle) NULL;
+	desc = _get_format_desc_from_android(dst_android->format_android);
+	ANDROID_RETURN_VAL_IF_FAIL(desc != NULL, 0);
+
+	dst_rect.x = dst_x;
+	dst_rect.y = dst_y;
+	dst_rect.width = width;
+	dst_rect.height = height;
+	src_rect.x = src_x;
+	src_rect.y = src_y;
+	src_rect.width = width;
+	src_rect.height = height;
+
+	ANDROID_RETURN_VAL_IF_FAIL(_rect_in_bo(dst_android, &dst_rect), 0);
+	ANDROID_RETURN_VAL_IF_FAIL(_rect_in_bo(src_android, &src_rect), 0);
+
+	/* the chroma planes are subsampled, the planar surface is copied whole */
+	if (desc->num_planes > 1 &&
+		(dst_x || dst_y || src_x || src_y ||
+		 width != dst_android->width || height != dst_android->height ||
+		 width != src_android->width || height != src_android->height)) {
+		TBM_LOG_E("bo:%p, only the whole planar surface can be copied",
+				  src_android);
+		return 0;
 	}
 
-	return bo_handle;
-}
+	same = dst_android == src_android;
+	if (same && dst_x == src_x && dst_y == src_y)
+		return 1;
 
-static tbm_bo_handle
-tbm_android_bo_map(tbm_bo bo, int device, int opt)
-{
-	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, (tbm_bo_handle) NULL);
+	memset(&blit, 0x0, sizeof(blit));
 
-	tbm_bo_handle bo_handle;
-	tbm_bo_android bo_android;
-	tbm_bufmgr_android bufmgr_android;
+	if (same) {
+		_rect_merge(&src_rect, &dst_rect);
 
-	bufmgr_android = (tbm_bufmgr_android) tbm_backend_get_bufmgr_priv(bo);
-	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, (tbm_bo_handle) NULL);
+		_android_bo_ref(src_android);
+		src_map = _android_bo_cpu_map(bufmgr_android->gralloc_module, src_android,
+									  TBM_OPTION_READ | TBM_OPTION_WRITE,
+									  &src_rect);
+		if (!src_map) {
+			_android_bo_unref_mapped(bufmgr_android->gralloc_module, src_android);
+			return 0;
+		}
+		dst_map = src_map;
 
-	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
-	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, (tbm_bo_handle) NULL);
+		blit.overlap = dst_x < src_x + width && src_x < dst_x + width &&
+					   dst_y < src_y + height && src_y < dst_y + height;
+		blit.backward = blit.overlap && dst_y > src_y;
+	} else {
+		_android_bo_ref(src_android);
+		src_map = _android_bo_cpu_map(bufmgr_android->gralloc_module, src_android,
+									  TBM_OPTION_READ, &src_rect);
+		if (!src_map) {
+			_android_bo_unref_mapped(bufmgr_android->gralloc_module, src_android);
+			return 0;
+		}
 
-	/*Get mapped bo_handle*/
-	bo_handle = _android_bo_handle(bufmgr_android, bo_android, device);
-	if (bo_handle.ptr == NULL) {
-		TBM_LOG_E("Cannot get handle: device:%d", device);
-		return (tbm_bo_handle) NULL;
+		_android_bo_ref(dst_android);
+		dst_map = _android_bo_cpu_map(bufmgr_android->gralloc_module, dst_android,
+									  TBM_OPTION_WRITE, &dst_rect);
+		if (!dst_map) {
+			_android_bo_unref_mapped(bufmgr_android->gralloc_module, dst_android);
+			_android_bo_unref_mapped(bufmgr_android->gralloc_module, src_android);
+			return 0;
+		}
+	}
+
+	/* the layouts are final once the buffers are mapped */
+	if (desc->num_planes > 1) {
+		for (i = 0; i < dst_android->layout.num_planes; i++) {
+			dst_pitch = dst_android->layout.pitch[i];
+			src_pitch = src_android->layout.pitch[i];
+			dst_rows = dst_android->layout.plane_size[i] / dst_pitch;
+			src_rows = src_android->layout.plane_size[i] / src_pitch;
+
+			_blit_add_part(&blit, dst_map + dst_android->layout.offset[i],
+						   dst_pitch, src_map + src_android->layout.offset[i],
+						   src_pitch, MIN(dst_pitch, src_pitch),
+						   MIN(dst_rows, src_rows));
+		}
+	} else {
+		dst_pitch = dst_android->layout.pitch[0];
+		src_pitch = src_android->layout.pitch[0];
+
+		_blit_add_part(&blit,
+					   dst_map + dst_android->layout.offset[0] +
+					   dst_y * dst_pitch + dst_x * desc->bpp, dst_pitch,
+					   src_map + src_android->layout.offset[0] +
+					   src_y * src_pitch + src_x * desc->bpp, src_pitch,
+					   width * desc->bpp, height);
 	}
 
-	bo_android->map_cnt++;
+	_blit_run(&blit);
 
-	DBG("bo:%p, handler:%p,\n		flags_tbm:%d, size:%d, map_cnt = %d, opt:%s",
-		bo_android, bo_android->handler, bo_android->flags_tbm,
-		bo_android->size, bo_android->map_cnt, STR_OPT[opt]);
+	DBG("bo:%p %d,%d -> bo:%p %d,%d, %dx%d", src_android, src_x, src_y,
+		dst_android, dst_x, dst_y, width, height);
 
-	return bo_handle;
+	if (!same)
+		_android_bo_unref_mapped(bufmgr_android->gralloc_module, dst_android);
+
+	return _android_bo_unref_mapped(bufmgr_android->gralloc_module, src_android);
 }
 
-static int
-tbm_android_bo_unmap(tbm_bo bo)
+int
+tbm_android_bo_fill(tbm_bo bo, int x, int y, int width, int height,
+					uint32_t pixel)
 {
-	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
-
-	int ret;
-	tbm_bo_android bo_android;
+	const struct _tbm_android_format_desc *desc;
+	struct _tbm_android_rect rect;
+	struct _tbm_android_blit blit;
 	tbm_bufmgr_android bufmgr_android;
-	const gralloc_module_t *gralloc_module;
+	tbm_bo_android bo_android;
+	uint8_t *map, *row;
+	uint32_t pitch, row_bytes, n;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bo != NULL, 0);
 
 	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_bufmgr_priv(bo);
 	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
 
-	gralloc_module = bufmgr_android->gralloc_module;
-	ANDROID_RETURN_VAL_IF_FAIL(gralloc_module != NULL, 0);
-
 	bo_android = (tbm_bo_android)tbm_backend_get_bo_priv(bo);
 	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
 
-	if (!bo_android->map_cnt) {
-		TBM_LOG_E("The buffer is not mapped");
+	desc = _get_format_desc_from_tbm(bo_android->format_tbm);
+	ANDROID_RETURN_VAL_IF_FAIL(desc != NULL, 0);
+
+	if (desc->num_planes > 1) {
+		TBM_LOG_E("bo:%p, the planar surface can't be filled", bo_android);
 		return 0;
 	}
 
-	bo_android->map_cnt--;
-
-	DBG("bo:%p, handler:%p, \n		flags_tbm:%d, size:%d, map_cnt = %d",
-		bo_android, bo_android->handler, bo_android->flags_tbm,
-		bo_android->size, bo_android->map_cnt);
+	rect.x = x;
+	rect.y = y;
+	rect.width = width;
+	rect.height = height;
+	ANDROID_RETURN_VAL_IF_FAIL(_rect_in_bo(bo_android, &rect), 0);
+
+	/* the rows are copies of the one filled here, doubling the pixels */
+	row_bytes = width * desc->bpp;
+	row = malloc(row_bytes);
+	if (!row) {
+		TBM_LOG_E("bo:%p, cannot allocate the row", bo_android);
+		return 0;
+	}
 
-	if (bo_android->map_cnt)
-		return 1;
+	memcpy(row, &pixel, desc->bpp);
+	for (n = desc->bpp; n < row_bytes; n *= 2)
+		memcpy(row + n, row, MIN(n, row_bytes - n));
 
-	ret = gralloc_module->unlock(gralloc_module, bo_android->handler);
-	if (ret) {
-		TBM_LOG_E("Cannot unlock buffer");
+	_android_bo_ref(bo_android);
+	map = _android_bo_cpu_map(bufmgr_android->gralloc_module, bo_android,
+							  TBM_OPTION_WRITE, &rect);
+	if (!map) {
+		_android_bo_unref_mapped(bufmgr_android->gralloc_module, bo_android);
+		free(row);
 		return 0;
 	}
 
-	bo_android->pBase = NULL;
+	memset(&blit, 0x0, sizeof(blit));
+	pitch = bo_android->layout.pitch[0];
+
+	_blit_add_part(&blit, map + bo_android->layout.offset[0] + y * pitch +
+				   x * desc->bpp, pitch, row, 0, row_bytes, height);
+	_blit_run(&blit);
+
+	free(row);
+
+	DBG("bo:%p, %d,%d %dx%d, pixel:0x%x", bo_android, x, y, width, height, pixel);
+
+	return _android_bo_unref_mapped(bufmgr_android->gralloc_module, bo_android);
+}
+
+int
+tbm_android_bufmgr_get_stats(tbm_bufmgr bufmgr, tbm_android_stats *stats)
+{
+	tbm_bufmgr_android bufmgr_android;
+	struct _tbm_android_stats_counters *counters;
+	uint64_t bytes;
+	unsigned int i, j;
+
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr != NULL, 0);
+	ANDROID_RETURN_VAL_IF_FAIL(stats != NULL, 0);
+
+	bufmgr_android = (tbm_bufmgr_android)tbm_backend_get_priv_from_bufmgr(bufmgr);
+	ANDROID_RETURN_VAL_IF_FAIL(bufmgr_android != NULL, 0);
+
+	counters = &bufmgr_android->stats;
+
+	/* the counters are read one by one, they may be slightly inconsistent */
+	memset(stats, 0x0, sizeof(*stats));
+	stats->live_bos = _stats_load(&counters->live_bos);
+	stats->live_bytes = _stats_load(&counters->live_bytes);
+	stats->allocs = _stats_load(&counters->allocs);
+	stats->frees = _stats_load(&counters->frees);
+	stats->imports = _stats_load(&counters->imports);
+	stats->maps = _stats_load(&counters->maps);
+	stats->unmaps = _stats_load(&counters->unmaps);
+
+	for (i = 0; i <= ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT &&
+		 stats->num_formats < TBM_ANDROID_STATS_FORMATS_MAX; i++) {
+		bytes = _stats_load(&counters->format_bytes[i]);
+		if (!bytes)
+			continue;
+
+		stats->formats[stats->num_formats].format =
+			i < ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT ?
+			android_tizen_formats[i].tbm_format : 0;
+		stats->formats[stats->num_formats].bytes = bytes;
+		stats->num_formats++;
+	}
+
+	for (i = 0; i <= ANDROID_TBM_FLAGS_MASK &&
+		 i < TBM_ANDROID_STATS_FLAGS_MAX; i++)
+		stats->flags_bytes[i] = _stats_load(&counters->flags_bytes[i]);
+
+	for (i = 0; i < TBM_ANDROID_STATS_LATENCIES; i++)
+		for (j = 0; j < TBM_ANDROID_STATS_HIST_BUCKETS; j++)
+			stats->latency[i][j] = _stats_load(&counters->latency[i][j]);
 
 	return 1;
 }
@@ -726,14 +5172,35 @@ tbm_android_bufmgr_deinit(void *priv)
 	ANDROID_RETURN_IF_FAIL(priv != NULL);
 
 	tbm_bufmgr_android bufmgr_android;
+	int slab_freed;
 
 	bufmgr_android = (tbm_bufmgr_android) priv;
 
-	gralloc_close(bufmgr_android->alloc_dev);
+	_stats_deinit(bufmgr_android);
+	_prewarm_deinit(bufmgr_android);
+	/* the worker trims the pool, it's stopped first */
+	_reclaim_deinit(bufmgr_android);
+	_pool_deinit(bufmgr_android);
+	_import_cache_deinit(&bufmgr_android->import_cache);
+	slab_freed = _slab_deinit(&bufmgr_android->slab);
+	_heap_deinit(bufmgr_android);
+
+	_android_gralloc_close(bufmgr_android);
+
+#ifdef QCOM_BSP
+	_adreno_utils_deinit();
+#endif
+
+	pthread_mutex_lock(&layout_cache.lock);
+	TBM_LOG_I("layout cache hits:%lu, misses:%lu",
+			  layout_cache.hits, layout_cache.misses);
+	pthread_mutex_unlock(&layout_cache.lock);
 
 	DBG("bufmgr:%p", bufmgr_android);
 
-	free(bufmgr_android);
+	/* the slab is a part of the bufmgr, the bos alive still return to it */
+	if (slab_freed)
+		free(bufmgr_android);
 }
 
 static int
@@ -752,7 +5219,7 @@ tbm_android_surface_supported_format(uint32_t **formats, uint32_t *num)
 		return 0;
 
 	for (i = 0; i < ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT; i++)
-		color_formats[i] = android_tizen_formats_map[i][1];
+		color_formats[i] = android_tizen_formats[i].tbm_format;
 
 	*formats = color_formats;
 	*num = ANDROID_TIZEN_FORMATS_MAP_ROWS_CNT;
@@ -780,14 +5247,7 @@ tbm_android_surface_get_plane_data(int width, int height,
 				  uint32_t *pitch, int *bo_idx)
 {
 	int ret, android_format;
-
-	/* As we use for allocate the buffer libgralloc, the offset and bo_idx is 0. */
-	if (offset) {
-		*offset = 0;
-	}
-	if (bo_idx) {
-		*bo_idx = 0;
-	}
+	struct _tbm_android_layout layout;
 
 	android_format = _get_android_format_from_tbm(tbm_format);
 	if (android_format < 0) {
@@ -795,9 +5255,33 @@ tbm_android_surface_get_plane_data(int width, int height,
 		return 0;
 	}
 
-	ret = _tbm_android_surface_get_data(width, height, android_format, size, pitch);
+	ret = _tbm_android_surface_get_data(width, height, android_format, &layout);
+	if (!ret)
+		return 0;
 
-	return ret;
+	if (plane_idx < 0 || plane_idx >= layout.num_planes) {
+		TBM_LOG_E("plane_idx(%d) is out of range for the format(%d)",
+				  plane_idx, tbm_format);
+		return 0;
+	}
+
+	plane_idx = _get_android_plane_idx(tbm_format, plane_idx);
+
+	if (size) {
+		*size = layout.plane_size[plane_idx];
+	}
+	if (offset) {
+		*offset = layout.offset[plane_idx];
+	}
+	if (pitch) {
+		*pitch = layout.pitch[plane_idx];
+	}
+	/* As we use for allocate the buffer libgralloc, the bo_idx is 0. */
+	if (bo_idx) {
+		*bo_idx = 0;
+	}
+
+	return 1;
 }
 
 static int
@@ -811,7 +5295,7 @@ tbm_android_bo_get_flags(tbm_bo bo)
 	ANDROID_RETURN_VAL_IF_FAIL(bo_android != NULL, 0);
 
 	DBG("bo:%p, handler:%p, flags_tbm:%d, size:%d", bo_android,
-			bo_android->handler, bo_android->flags_tbm, bo_android->size);
+			bo_android->handler, bo_android->flags_tbm, bo_android->layout.size);
 
 	return bo_android->flags_tbm;
 }
@@ -820,7 +5304,6 @@ static int
 init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 {
 	char *env;
-	int ret;
 	tbm_bufmgr_android bufmgr_android;
 	tbm_bufmgr_backend bufmgr_backend;
 
@@ -851,26 +5334,28 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 		return 0;
 	}
 
-	ret =
-		hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
-					  (const hw_module_t **)&bufmgr_android->gralloc_module);
-	if (ret || !bufmgr_android->gralloc_module) {
-		TBM_LOG_E("Cannot get gralloc hardware module!");
-		goto fail_1;
-	}
+	/* the gralloc is loaded at the first allocation or import */
+	pthread_mutex_init(&bufmgr_android->gralloc_lock, NULL);
 
-	ret =
-		gralloc_open((const hw_module_t *)bufmgr_android->gralloc_module,
-					 &bufmgr_android->alloc_dev);
-	if (ret || !&bufmgr_android->alloc_dev) {
-		TBM_LOG_E("Cannot open the gralloc!");
-		goto fail_1;
-	}
+	/* the workers may open the gralloc and allocate right away */
+	env = getenv("TBM_BACKEND_PERSISTENT_MAP");
+	bPersistentMap = env ? atoi(env) : 0;
 
-	TBM_LOG_I("gralloc version: %x.\n",
-			  bufmgr_android->alloc_dev->common.version & 0xFFFF0000);
-	TBM_LOG_I("gralloc module api version: %hu.\n",
-			  bufmgr_android->alloc_dev->common.module->module_api_version);
+	env = getenv("TBM_BACKEND_ASYNC_LOCK");
+	__atomic_store_n(&bufmgr_android->async_lock, env ? atoi(env) : 0,
+					 __ATOMIC_RELEASE);
+
+#ifdef QCOM_BSP
+	_adreno_utils_init();
+#endif
+
+	_pool_init(&bufmgr_android->pool);
+	_import_cache_init(&bufmgr_android->import_cache);
+	_slab_init(&bufmgr_android->slab);
+	_reclaim_init(bufmgr_android);
+	_heap_init(bufmgr_android);
+	_stats_init(bufmgr_android);
+	_prewarm_init(bufmgr_android);
 
 	bufmgr_backend = tbm_backend_alloc();
 	if (!bufmgr_backend) {
@@ -897,17 +5382,21 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 	bufmgr_backend->bo_map = tbm_android_bo_map;
 	bufmgr_backend->bo_unmap = tbm_android_bo_unmap;
 
-	/* Android provides an itself lock/unlock mechanism, look at tbm_android_bo_map */
+	/*
+	 * Android provides an itself lock/unlock mechanism for the cpu, look at
+	 * tbm_android_bo_map. The lock makes the device wait for the async unlock,
+	 * the device access produces no fence, so there's nothing to unlock.
+	 */
 	bufmgr_backend->bo_unlock = NULL;
-	bufmgr_backend->bo_lock = NULL;
+	bufmgr_backend->bo_lock = tbm_android_bo_lock;
 
 	bufmgr_backend->surface_supported_format =
 										tbm_android_surface_supported_format;
 	bufmgr_backend->surface_get_plane_data = tbm_android_surface_get_plane_data;
 
-	/* Android doesn't provide ability to share buffer across fd */
-	bufmgr_backend->bo_import_fd = NULL;
-	bufmgr_backend->bo_export_fd = NULL;
+	/* the fd is the dma-buf (or the memfd) of the buffer */
+	bufmgr_backend->bo_import_fd = tbm_android_bo_import_fd;
+	bufmgr_backend->bo_export_fd = tbm_android_bo_export_fd;
 
 	bufmgr_backend->bo_get_flags = tbm_android_bo_get_flags;
 	bufmgr_backend->bufmgr_bind_native_display = NULL;
@@ -972,8 +5461,18 @@ init_tbm_bufmgr_priv(tbm_bufmgr bufmgr, int fd)
 	return 1;
 
 fail_2:
-	gralloc_close(bufmgr_android->alloc_dev);
-fail_1:
+	_stats_deinit(bufmgr_android);
+	_prewarm_deinit(bufmgr_android);
+	/* the worker trims the pool, it's stopped first */
+	_reclaim_deinit(bufmgr_android);
+	_pool_deinit(bufmgr_android);
+	_import_cache_deinit(&bufmgr_android->import_cache);
+	_slab_deinit(&bufmgr_android->slab);
+	_heap_deinit(bufmgr_android);
+	_android_gralloc_close(bufmgr_android);
+#ifdef QCOM_BSP
+	_adreno_utils_deinit();
+#endif
 	free(bufmgr_android);
 
 	return 0;
@@ -0,0 +1,275 @@
+/**************************************************************************
+
+libtbm_android
+
+Copyright 2016 Samsung Electronics co., Ltd. All Rights Reserved.
+
+Contact: Konstantin Drabeniuk <k.drabeniuk@samsung.com>,
+		 Sergey Sizonov <s.sizonov@samsung.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sub license, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice (including the
+next paragraph) shall be included in all copies or substantial portions
+of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+**************************************************************************/
+
+#ifndef _TBM_BUFMGR_ANDROID_H_
+#define _TBM_BUFMGR_ANDROID_H_
+
+#include <tbm_bufmgr.h>
+
+/*
+ * The extensions of the android tbm backend.
+ *
+ * These functions aren't part of the libtbm API, they are exported by the
+ * backend module and work only with the bos of the android bufmgr.
+ */
+
+/*
+ * The sharing of the bos.
+ *
+ * The tbm_fd of tbm_bo_export_fd is the dma-buf of the buffer, the first fd
+ * of its gralloc native handle (the memfd for the heap engine buffers), as
+ * with the other backends. The surface layout isn't in it, it travels out of
+ * band, e.g. as the tbm surface info. tbm_bo_import_fd gives the bo of the
+ * bare buffer: the cpu maps it and TBM_DEVICE_MM gives its fd, but it has no
+ * gralloc handle for the gpu. The buffer shared by its native handle
+ * (tbm_bo_export / tbm_bo_import) keeps the gralloc metadata.
+ *
+ * The bos of the heap engine (TBM_BACKEND_HEAP_FLAGS) and the ones imported
+ * by the tbm_fd aren't gralloc buffers: TBM_DEVICE_DEFAULT, 2D and 3D give
+ * no handle for them and tbm_bo_export fails, they're shared only by the
+ * tbm_fd.
+ *
+ * The native handle given to tbm_bo_import stays owned by the caller, it's
+ * registered in the gralloc and used by the bo until the bo is freed, then
+ * the caller closes it. The buffer imported again, e.g. by a new handle the
+ * binder has duplicated, gets the bo of the first import: the new handle is
+ * neither registered nor used, the caller may close it right away, while the
+ * first one has to live until the last reference of the bo is gone.
+ * tbm_bo_export gives the handle the bo uses.
+ */
+
+/**
+ * @brief set the surface of the bo imported by the tbm_fd.
+ * @note The bo of the bare buffer has no surface: it's one plane of the
+ * buffer size, the region maps, bo_copy and bo_fill refuse it. The layout
+ * travels out of band, e.g. as the tbm surface info of the exporter, and
+ * is set here before the bo is mapped. The given pitch also becomes the
+ * plane data of this size and format in the process, so the surfaces made
+ * of the bo match the exporter's.
+ * @param[in] bo : the bo imported by tbm_bo_import_fd
+ * @param[in] width, height : the size of the surface
+ * @param[in] tbm_format : the tbm format of the surface
+ * @param[in] pitch : the bytes per row of the first plane or 0 to estimate it
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_set_surface(tbm_bo bo, int width, int height,
+						   uint32_t tbm_format, uint32_t pitch);
+
+/**
+ * @brief map the region of the bo for the cpu access.
+ * @note Only the region is locked in the gralloc, so the cache maintenance
+ * covers only the touched lines. The overlapping maps of the same bo are
+ * merged, the buffer stays locked for the union of them.
+ * @param[in] bo : the bo to map
+ * @param[in] opt : TBM_OPTION_READ and/or TBM_OPTION_WRITE
+ * @param[in] x, y, width, height : the region of the surface, in pixels
+ * @return the handle with the address of the whole buffer (not of the region),
+ * the handle with NULL pointer in an error case.
+ */
+tbm_bo_handle
+tbm_android_bo_map_region(tbm_bo bo, int opt, int x, int y, int width,
+						  int height);
+
+/**
+ * @brief unmap the bo mapped by tbm_android_bo_map_region.
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_unmap_region(tbm_bo bo);
+
+/**
+ * @brief set the fence the next cpu access of the bo has to wait for.
+ * @note The backend takes the ownership of the fence. It's waited only when
+ * the buffer gets locked for the cpu access, with TBM_BACKEND_ASYNC_LOCK=1
+ * and a gralloc module supporting lockAsync the gralloc waits for it.
+ * The bo must not be mapped for the cpu access.
+ * @param[in] bo : the bo
+ * @param[in] fence_fd : the sync fence fd
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_set_acquire_fence(tbm_bo bo, int fence_fd);
+
+/**
+ * @brief get the fence signalled when the last cpu access of the bo is done.
+ * @note The caller takes the ownership of the fence. The fences are produced
+ * only with TBM_BACKEND_ASYNC_LOCK=1, otherwise the unmap waits by itself.
+ * The device map by tbm_bo_map waits for the fence of the bo itself, such fence
+ * isn't given here anymore.
+ * @return the sync fence fd or -1 if there is nothing to wait for.
+ */
+int
+tbm_android_bo_get_release_fence(tbm_bo bo);
+
+/**
+ * @brief keep the bo locked for the cpu access after the last unmap.
+ * @note The cpu address stays valid between the maps and the gralloc
+ * lock/unlock with its cache maintenance is skipped. The buffer is unlocked
+ * (flushed) only when a device gets the bo handle, the bo is exported, gets
+ * the acquire fence or its release fence is requested. The default is set
+ * by TBM_BACKEND_PERSISTENT_MAP=1.
+ * @param[in] bo : the bo
+ * @param[in] enable : 1 to keep the mapping, 0 to unlock at the last unmap
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_set_persistent(tbm_bo bo, int enable);
+
+/**
+ * @brief flush the cpu writes of the persistently mapped bo.
+ * @note Needed only when a device accesses the buffer bypassing the tbm,
+ * the next map invalidates the cpu caches. The bo mapped right now is left
+ * as is.
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_flush(tbm_bo bo);
+
+/**
+ * @brief allocate @c count more buffers like the one of the bo.
+ * @note The buffers are allocated in parallel and kept in the recycling pool,
+ * so the next @c count surfaces of the same size, format and flags are
+ * allocated without waiting for the gralloc, e.g. the rest of a swapchain.
+ * Either all the buffers are allocated or none. The buffers which stay
+ * unused are freed as the idle ones of the pool.
+ * @param[in] bo : the bo allocated by the gralloc, neither imported nor
+ * wrapped
+ * @param[in] count : the amount of the buffers, 16 at most
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_prealloc(tbm_bo bo, int count);
+
+/**
+ * @brief copy the region of the surface to another bo of the same format.
+ * @note The pitches of both bos are taken into account, the buffers are
+ * mapped and unmapped inside. The regions of the same bo may overlap. The
+ * planar (yuv) surfaces are copied only whole. The big surfaces are copied
+ * by several threads.
+ * @param[in] dst : the destination bo
+ * @param[in] dst_x, dst_y : the destination position, in pixels
+ * @param[in] src : the source bo, can be @c dst
+ * @param[in] src_x, src_y, width, height : the source region, in pixels
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_copy(tbm_bo dst, int dst_x, int dst_y, tbm_bo src, int src_x,
+					int src_y, int width, int height);
+
+/**
+ * @brief fill the region of the surface with the pixel.
+ * @note Only the single plane formats can be filled.
+ * @param[in] bo : the bo
+ * @param[in] x, y, width, height : the region, in pixels
+ * @param[in] pixel : the pixel value in the tbm format of the bo, e.g.
+ * 0xff000000 is the opaque black of TBM_FORMAT_ARGB8888
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bo_fill(tbm_bo bo, int x, int y, int width, int height,
+					uint32_t pixel);
+
+/* the magic of tbm_android_user_memory */
+#define TBM_ANDROID_USER_MEMORY_MAGIC 0x54424d55 /* "TBMU" */
+
+/**
+ * @brief the user memory to be wrapped as a bo without a copy.
+ * @note Pass it to the native import of libtbm instead of the native handle,
+ * the backend tells them apart by the magic. The cpu handles of the bo are
+ * the memory itself, the codecs (TBM_DEVICE_MM) get the fd, the gpu and the
+ * display can't use the bo. Only the mapped fd can be exported (as the
+ * tbm_fd), the bo has no native handle and can't be preallocated. The planar
+ * surface must have the layout gralloc would give it with the pitch, e.g.
+ * the chroma planes of YV12 are aligned to 16 bytes.
+ */
+typedef struct _tbm_android_user_memory {
+	unsigned int magic;    /* TBM_ANDROID_USER_MEMORY_MAGIC */
+	void *ptr;             /* the memory or NULL to map the fd */
+	int fd;                /* the memfd or dma-buf mapped if there is no ptr,
+							* it stays owned by the caller */
+	uint32_t offset;       /* of the memory in the fd, page-aligned */
+	uint32_t size;         /* of the memory in bytes */
+	int width;
+	int height;
+	uint32_t format;       /* the tbm format */
+	uint32_t pitch;        /* bytes per row of the first plane */
+	void (*release)(void *data); /* called when the bo is freed, or NULL */
+	void *release_data;
+} tbm_android_user_memory;
+
+/* the latency histogram has log2 buckets of microseconds */
+#define TBM_ANDROID_STATS_HIST_BUCKETS 24
+#define TBM_ANDROID_STATS_FORMATS_MAX  32
+#define TBM_ANDROID_STATS_FLAGS_MAX    8
+
+/* the measured calls */
+enum {
+	TBM_ANDROID_STATS_ALLOC,   /* the gralloc allocation */
+	TBM_ANDROID_STATS_LOCK,    /* the gralloc cpu lock, with the acquire fence */
+	TBM_ANDROID_STATS_UNLOCK,  /* the gralloc cpu unlock */
+	TBM_ANDROID_STATS_LATENCIES
+};
+
+/**
+ * @brief the statistics of the bufmgr.
+ * @note The bucket 0 of the histograms counts the calls shorter than 1us,
+ * the bucket i the calls of [2^(i-1), 2^i) us, the last one the longer ones.
+ */
+typedef struct _tbm_android_stats {
+	uint64_t live_bos;
+	uint64_t live_bytes;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t imports;
+	uint64_t maps;
+	uint64_t unmaps;
+	int num_formats;
+	struct {
+		uint32_t format;   /* the tbm format, 0 - the unknown ones */
+		uint64_t bytes;
+	} formats[TBM_ANDROID_STATS_FORMATS_MAX];  /* the live bytes by format */
+	uint64_t flags_bytes[TBM_ANDROID_STATS_FLAGS_MAX]; /* by the tbm flags */
+	uint64_t latency[TBM_ANDROID_STATS_LATENCIES][TBM_ANDROID_STATS_HIST_BUCKETS];
+} tbm_android_stats;
+
+/**
+ * @brief get the statistics of the bufmgr.
+ * @note The counters are always on. They're also logged at the bufmgr
+ * deinit and on the signal TBM_BACKEND_STATS_SIGNAL=<signal number>.
+ * @param[in] bufmgr : the bufmgr of the android backend
+ * @param[out] stats : the statistics
+ * @return 1 if this function succeeds, otherwise 0.
+ */
+int
+tbm_android_bufmgr_get_stats(tbm_bufmgr bufmgr, tbm_android_stats *stats);
+
+#endif /* _TBM_BUFMGR_ANDROID_H_ */